@@ -0,0 +1,62 @@
+/*
+ Automatic reconnection example
+
+ This sketch demonstrates how to let the client keep itself
+ connected. Once connect() has been called, loop() reconnects
+ whenever the connection is lost, without blocking, waiting a
+ little longer after each failed attempt.
+
+*/
+
+#include <SPI.h>
+#include <Ethernet.h>
+#include <PubSubClient.h>
+
+// Update these with values suitable for your hardware/network.
+byte mac[]    = {  0xDE, 0xED, 0xBA, 0xFE, 0xFE, 0xED };
+IPAddress ip(172, 16, 0, 100);
+IPAddress server(172, 16, 0, 2);
+
+void callback(char* topic, byte* payload, unsigned int length) {
+  // handle message arrived
+}
+
+EthernetClient ethClient;
+PubSubClient client(ethClient);
+
+boolean subscribed = false;
+
+void onConnect(int state) {
+  if (state == MQTT_CONNECTED) {
+    // Once connected, publish an announcement...
+    client.publish("outTopic","hello world");
+    // ... and subscribe the first time. The client remembers the
+    // subscription and makes it again after any later reconnect
+    if (!subscribed) {
+      subscribed = client.subscribe("inTopic");
+    }
+  }
+}
+
+void setup()
+{
+  // Seed the random waits between attempts differently on each board,
+  // from the noise on an unconnected analog pin
+  randomSeed(analogRead(0));
+
+  client.setServer(server, 1883);
+  client.setCallback(callback);
+  client.setConnectCallback(onConnect);
+  // Retry after 1 second at first, backing off to at most a minute
+  client.setAutoReconnect(true, 1000, 60000);
+
+  Ethernet.begin(mac, ip);
+  delay(1500);
+
+  client.beginConnect("arduinoClient");
+}
+
+void loop()
+{
+  client.loop();
+}
@@ -25,13 +25,17 @@ EthernetClient ethClient;
 PubSubClient client(ethClient);
 
 long lastReconnectAttempt = 0;
+boolean subscribed = false;
 
 boolean reconnect() {
   if (client.connect("arduinoClient")) {
     // Once connected, publish an announcement...
     client.publish("outTopic","hello world");
-    // ... and resubscribe
-    client.subscribe("inTopic");
+    // ... and subscribe the first time. The client remembers the
+    // subscription and makes it again after any later reconnect
+    if (!subscribed) {
+      subscribed = client.subscribe("inTopic");
+    }
   }
   return client.connected();
 }
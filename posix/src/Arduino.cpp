@@ -0,0 +1,44 @@
+/*
+ Arduino.cpp - Host versions of the Arduino core functions PubSubClient uses.
+*/
+
+#include "Arduino.h"
+
+#include <time.h>
+#include <sched.h>
+
+unsigned long millis(void) 
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (unsigned long) now.tv_sec * 1000UL + now.tv_nsec / 1000000L;
+}
+
+unsigned long micros(void) 
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (unsigned long) now.tv_sec * 1000000UL + now.tv_nsec / 1000L;
+}
+
+void yield(void) 
+{
+  sched_yield();
+}
+
+void delay(unsigned long ms) 
+{
+  struct timespec wait = { (time_t) (ms / 1000), (long) (ms % 1000) * 1000000L };
+
+  while (nanosleep(&wait, &wait) != 0) {
+  }
+}
+
+long random(long howbig) 
+{
+  return (howbig > 0) ? (::random() % howbig) : 0;
+}
@@ -0,0 +1,37 @@
+/*
+ Arduino.h - The parts of the Arduino core PubSubClient needs, for building
+ it natively on Linux and other POSIX hosts.
+*/
+
+#ifndef Arduino_h
+#define Arduino_h
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "Print.h"
+
+typedef uint8_t byte;
+typedef bool    boolean;
+
+// Milliseconds since an arbitrary point, from the monotonic clock
+unsigned long millis(void);
+
+// Microseconds since an arbitrary point, from the monotonic clock
+unsigned long micros(void);
+
+// Let other threads run
+void yield(void);
+
+void delay(unsigned long ms);
+
+// A random number from 0 to howbig - 1
+long random(long howbig);
+
+#define PROGMEM
+#define pgm_read_byte_near(x) (*(const uint8_t *) (x))
+#define memcpy_P memcpy
+#define memcmp_P memcmp
+
+#endif
@@ -0,0 +1,236 @@
+/*
+ EpollReactor.cpp - Drives many PubSubClients over PosixClients from one thread, on Linux.
+*/
+
+#include "EpollReactor.h"
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#if (EPOLL_REACTOR_SLOTS & (EPOLL_REACTOR_SLOTS - 1)) != 0
+  #error "EPOLL_REACTOR_SLOTS must be a power of two"
+#endif
+
+#define EPOLL_REACTOR_EVENTS 64
+
+EpollReactor::EpollReactor() :
+_epoll(-1),
+_entries(nullptr),
+_count(0),
+_capacity(0),
+_tick(millis() / EPOLL_REACTOR_TICK),
+_wheel()
+{
+}
+
+EpollReactor::~EpollReactor() 
+{
+  for (size_t i = 0; i < _count; i++) {
+    delete _entries[i];
+  }
+
+  free(_entries);
+
+  if (_epoll >= 0) close(_epoll);
+}
+
+boolean EpollReactor::add(PubSubClient & client, PosixClient & socket, unsigned long writeTimeout) 
+{
+  if (_epoll < 0) {
+    _epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (_epoll < 0) return false;
+  }
+
+  if (_count == _capacity) {
+    size_t   capacity = _capacity ? (_capacity * 2) : 16;
+    Entry ** entries  = (Entry **) realloc(_entries, capacity * sizeof(Entry *));
+
+    if (entries == nullptr) return false;
+
+    _entries  = entries;
+    _capacity = capacity;
+  }
+
+  socket.setTimeout(writeTimeout);
+
+  Entry * entry = new Entry();
+
+  entry->client = &client;
+  entry->socket = &socket;
+  entry->fd     = -1;
+  entry->index  = _count;
+
+  _entries[_count++] = entry;
+
+  // Run it on the next tick, which also registers its socket
+  schedule(entry, _tick + 1);
+
+  return true;
+}
+
+void EpollReactor::remove(PubSubClient & client) 
+{
+  for (size_t i = 0; i < _count; i++) {
+    Entry * entry = _entries[i];
+
+    if (entry->client != &client) continue;
+
+    unschedule(entry);
+    if (watching(entry)) epoll_ctl(_epoll, EPOLL_CTL_DEL, entry->fd, nullptr);
+
+    _entries[i]        = _entries[--_count];
+    _entries[i]->index = i;
+
+    delete entry;
+    return;
+  }
+}
+
+size_t EpollReactor::size() const 
+{
+  return _count;
+}
+
+int EpollReactor::run(int timeout) 
+{
+  if (_epoll < 0) return 0;
+
+  unsigned long now  = millis();
+  unsigned long tick = now / EPOLL_REACTOR_TICK;
+  int           wait = (int) (((tick + 1) * EPOLL_REACTOR_TICK) - now);
+
+  // Wake for the next tick of the wheel, if the caller would wait longer
+  if ((timeout >= 0) && (timeout < wait)) wait = timeout;
+
+  struct epoll_event events[EPOLL_REACTOR_EVENTS];
+  int                ready = epoll_wait(_epoll, events, EPOLL_REACTOR_EVENTS, wait);
+
+  if (ready < 0) return (errno == EINTR) ? 0 : -1;
+
+  now = millis();
+
+  for (int i = 0; i < ready; i++) {
+    service((Entry *) events[i].data.ptr, now);
+  }
+
+  return ready + expire(now);
+}
+
+// Turns the wheel to the current tick, running every client found due in the slots passed
+int EpollReactor::expire(unsigned long now) 
+{
+  unsigned long tick = now / EPOLL_REACTOR_TICK;
+  int           run  = 0;
+
+  // After a long stall one turn of the wheel covers every slot
+  if ((tick - _tick) > EPOLL_REACTOR_SLOTS) _tick = tick - EPOLL_REACTOR_SLOTS;
+
+  while (_tick != tick) {
+    _tick++;
+
+    Entry * entry = _wheel[_tick & (EPOLL_REACTOR_SLOTS - 1)];
+
+    while (entry != nullptr) {
+      Entry * next = entry->next;
+
+      // Those due on a later turn stay where they are
+      if ((long) (entry->due - tick) <= 0) {
+        service(entry, now);
+        run++;
+      }
+
+      entry = next;
+    }
+  }
+
+  return run;
+}
+
+// Runs a client's loop(), then works out when it next needs to run
+void EpollReactor::service(Entry * entry, unsigned long now) 
+{
+  PubSubClient * client = entry->client;
+  int            burst  = 0;
+
+  do {
+    client->loop();
+  } while ((entry->socket->buffered() > 0) && (++burst < EPOLL_REACTOR_BURST));
+
+  watch(entry);
+
+  unsigned long tick = now / EPOLL_REACTOR_TICK;
+
+  if ((entry->socket->buffered() > 0) || (client->state() == MQTT_CONNECTING)) {
+    // More already read, or a socket that epoll is not told has opened, on the next tick
+    schedule(entry, tick + 1);
+  }
+  else {
+    unsigned long wait = client->nextDeadline();
+
+    if (wait > ((EPOLL_REACTOR_SLOTS - 1) * EPOLL_REACTOR_TICK)) wait = (EPOLL_REACTOR_SLOTS - 1) * EPOLL_REACTOR_TICK;
+
+    unsigned long due = (now + wait + EPOLL_REACTOR_TICK - 1) / EPOLL_REACTOR_TICK;
+    schedule(entry, ((long) (due - tick) > 0) ? due : (tick + 1));
+  }
+}
+
+// Whether the socket epoll watches for the client is still open. Once it has been closed its
+// descriptor may belong to another client's socket, so it must not be touched
+boolean EpollReactor::watching(Entry * entry) 
+{
+  return (entry->fd >= 0) && (entry->fd == entry->socket->fd()) && 
+         (entry->connection == entry->socket->connections());
+}
+
+// Keeps epoll watching the client's current socket, which changes when it reconnects
+void EpollReactor::watch(Entry * entry) 
+{
+  int      fd         = entry->socket->fd();
+  uint32_t connection = entry->socket->connections();
+
+  if (watching(entry)) return;
+
+  // The old socket was closed, which took it out of epoll
+  entry->fd         = -1;
+  entry->connection = connection;
+
+  if (fd >= 0) {
+    struct epoll_event event;
+
+    event.events   = EPOLLIN | EPOLLRDHUP;
+    event.data.ptr = entry;
+
+    if (epoll_ctl(_epoll, EPOLL_CTL_ADD, fd, &event) == 0) entry->fd = fd;
+  }
+}
+
+void EpollReactor::schedule(Entry * entry, unsigned long due) 
+{
+  unschedule(entry);
+
+  Entry ** slot = &_wheel[due & (EPOLL_REACTOR_SLOTS - 1)];
+
+  entry->due  = due;
+  entry->prev = nullptr;
+  entry->next = *slot;
+
+  if (*slot != nullptr) (*slot)->prev = entry;
+  *slot = entry;
+}
+
+void EpollReactor::unschedule(Entry * entry) 
+{
+  Entry ** slot = &_wheel[entry->due & (EPOLL_REACTOR_SLOTS - 1)];
+
+  if (entry->prev != nullptr) {
+    entry->prev->next = entry->next;
+  }
+  else if (*slot == entry) {
+    *slot = entry->next;
+  }
+
+  if (entry->next != nullptr) entry->next->prev = entry->prev;
+
+  entry->next = entry->prev = nullptr;
+}
@@ -0,0 +1,94 @@
+/*
+ EpollReactor.h - Drives many PubSubClients over PosixClients from one thread, on Linux.
+*/
+
+#ifndef EpollReactor_h
+#define EpollReactor_h
+
+#include "Arduino.h"
+#include "PubSubClient.h"
+#include "PosixClient.h"
+
+// EPOLL_REACTOR_TICK : Milliseconds per slot of the timer wheel, the precision of deadlines
+#ifndef EPOLL_REACTOR_TICK
+  #define EPOLL_REACTOR_TICK 100
+#endif
+
+// EPOLL_REACTOR_SLOTS : Slots in the timer wheel, a power of two. Deadlines further off than
+//  a turn of the wheel wait in their slot for the turns in between
+#ifndef EPOLL_REACTOR_SLOTS
+  #define EPOLL_REACTOR_SLOTS 1024
+#endif
+
+// EPOLL_REACTOR_BURST : Packets a client may handle in a row when its PosixClient has read
+//  several at once, before the others get a turn
+#ifndef EPOLL_REACTOR_BURST
+  #define EPOLL_REACTOR_BURST 16
+#endif
+
+// EPOLL_REACTOR_WRITE_TIMEOUT : Milliseconds add() lets a socket wait for room to write, by
+//  default. 0 fails a write that finds the socket full at once
+#ifndef EPOLL_REACTOR_WRITE_TIMEOUT
+  #define EPOLL_REACTOR_WRITE_TIMEOUT 0
+#endif
+
+// Runs the loop() of each of many clients only when there is something for it to do: when
+// its socket has data, or when the deadline from its nextDeadline() comes round. The sockets
+// are watched with epoll and the deadlines are kept in a timer wheel, so each call to run()
+// costs time in proportion to the clients that need attention rather than to all of them.
+// While a client waits for its socket to open it is run every tick instead, and one with no
+// deadline is still run once per turn of the wheel.
+//
+// A PosixClient writing to a full socket waits for it to drain for up to its setTimeout(),
+// and every other client of the reactor waits with it. add() therefore gives each socket a
+// short write timeout, so that a connection that cannot keep up is dropped rather than
+// stalling the rest.
+class EpollReactor {
+public:
+  EpollReactor();
+  ~EpollReactor();
+
+  // Start running a client, which must use socket as its network client. The socket's
+  // setTimeout() is set to writeTimeout
+  // Returns false if the reactor could not be set up
+  boolean add(PubSubClient & client, PosixClient & socket, unsigned long writeTimeout = EPOLL_REACTOR_WRITE_TIMEOUT);
+
+  // Stop running a client
+  void remove(PubSubClient & client);
+
+  // Wait up to timeout milliseconds (or for ever if negative) for sockets with data or deadlines
+  // that have come round, and run the loop() of each client they belong to.
+  // Returns the number of clients run, or -1 if waiting failed
+  int run(int timeout);
+
+  // The number of clients added
+  size_t size() const;
+
+private:
+  struct Entry {
+    PubSubClient  * client;
+    PosixClient   * socket;
+    int             fd;       // The socket registered with epoll, or -1
+    uint32_t        connection;
+    unsigned long   due;      // The tick the client is next due to run at
+    Entry         * next;     // Neighbours in the wheel slot for due
+    Entry         * prev;
+    size_t          index;    // Position in _entries
+  };
+
+  int             _epoll;
+  Entry        ** _entries;
+  size_t          _count;
+  size_t          _capacity;
+  unsigned long   _tick;      // The last tick the wheel has been turned to
+  Entry         * _wheel[EPOLL_REACTOR_SLOTS];
+
+  void    service(Entry * entry, unsigned long now);
+  void   schedule(Entry * entry, unsigned long due);
+  void unschedule(Entry * entry);
+  void      watch(Entry * entry);
+  boolean watching(Entry * entry);
+  int      expire(unsigned long now);
+};
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef IPAddress_h
+#define IPAddress_h
+
+#include <stdint.h>
+#include <string.h>
+
+// An IPv4 address, held in network order
+class IPAddress {
+public:
+  IPAddress() : _address{ 0, 0, 0, 0 } {}
+  IPAddress(uint8_t first, uint8_t second, uint8_t third, uint8_t fourth) : _address{ first, second, third, fourth } {}
+  IPAddress(uint32_t address) { memcpy(_address, &address, sizeof(_address)); }
+  IPAddress(const uint8_t * address) { memcpy(_address, address, sizeof(_address)); }
+
+  operator uint32_t() const
+  {
+    uint32_t address;
+    memcpy(&address, _address, sizeof(address));
+    return address;
+  }
+
+  uint8_t   operator[](int index) const { return _address[index]; }
+  uint8_t & operator[](int index) { return _address[index]; }
+
+private:
+  uint8_t _address[4];
+};
+
+#endif
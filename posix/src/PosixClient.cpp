@@ -0,0 +1,364 @@
+/*
+ PosixClient.cpp - A Client for PubSubClient over a non-blocking POSIX TCP socket.
+*/
+
+#include "PosixClient.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#ifndef MSG_NOSIGNAL
+  #define MSG_NOSIGNAL 0
+#endif
+
+PosixClient::PosixClient() :
+_fd(-1),
+_open(false),
+_closed(false),
+_noDelay(true),
+_timeout(POSIX_CLIENT_TIMEOUT),
+_connections(0),
+_head(0),
+_tail(0)
+{
+}
+
+PosixClient::~PosixClient() 
+{
+  stop();
+}
+
+int PosixClient::connect(IPAddress ip, uint16_t port) 
+{
+  struct sockaddr_in address;
+
+  memset(&address, 0, sizeof(address));
+  address.sin_family      = AF_INET;
+  address.sin_port        = htons(port);
+  address.sin_addr.s_addr = (uint32_t) ip;
+
+  return open((const struct sockaddr *) &address, sizeof(address));
+}
+
+int PosixClient::connect(const char * host, uint16_t port) 
+{
+  struct addrinfo   hints;
+  struct addrinfo * found;
+  char              service[6];
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family   = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+
+  snprintf(service, sizeof(service), "%u", port);
+
+  if (getaddrinfo(host, service, &hints, &found) != 0) return 0;
+
+  int result = 0;
+
+  for (struct addrinfo * a = found; (a != nullptr) && !result; a = a->ai_next) {
+    result = open(a->ai_addr, a->ai_addrlen);
+  }
+
+  freeaddrinfo(found);
+
+  return result;
+}
+
+// Starts connecting a new socket to an address. Returns 1 if the connection is open or under way
+int PosixClient::open(const struct sockaddr * address, unsigned int length) 
+{
+  stop();
+
+  _fd = socket(address->sa_family, SOCK_STREAM, 0);
+  if (_fd < 0) return 0;
+
+  _connections++;
+
+  int flags = fcntl(_fd, F_GETFL, 0);
+  int on    = _noDelay ? 1 : 0;
+
+  if ((flags < 0) || (fcntl(_fd, F_SETFL, flags | O_NONBLOCK) < 0)) {
+    stop();
+    return 0;
+  }
+
+  setsockopt(_fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+  #ifdef SO_NOSIGPIPE
+    setsockopt(_fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+  #endif
+
+  if (::connect(_fd, address, length) == 0) {
+    _open = true;
+  }
+  else if (errno != EINPROGRESS) {
+    stop();
+    return 0;
+  }
+
+  return 1;
+}
+
+size_t PosixClient::write(uint8_t b) 
+{
+  return write(&b, 1);
+}
+
+size_t PosixClient::write(const uint8_t * buf, size_t size) 
+{
+  MQTTIOVec iov = { buf, size };
+
+  return writev(&iov, 1);
+}
+
+size_t PosixClient::writev(const MQTTIOVec * iov, uint8_t count) 
+{
+  struct iovec vec[8];
+  uint8_t      n     = 0;
+  size_t       total = 0;
+
+  if (!connected()) return 0;
+
+  // Buffers past the first eight are sent by a second call
+  if (count > 8) {
+    size_t sent = writev(iov, 8);
+    for (uint8_t i = 0; i < 8; i++) total += iov[i].length;
+    return (sent < total) ? sent : (sent + writev(iov + 8, count - 8));
+  }
+
+  for (uint8_t i = 0; i < count; i++) {
+    if (iov[i].length == 0) continue;
+    vec[n].iov_base = (void *) iov[i].base;
+    vec[n].iov_len  = iov[i].length;
+    total          += iov[i].length;
+    n++;
+  }
+
+  size_t         sent = 0;
+  struct iovec * v    = vec;
+
+  while (sent < total) {
+    struct msghdr message;
+
+    memset(&message, 0, sizeof(message));
+    message.msg_iov    = v;
+    message.msg_iovlen = n;
+
+    ssize_t rc = sendmsg(_fd, &message, MSG_NOSIGNAL);
+
+    if (rc < 0) {
+      if (errno == EINTR) continue;
+      if (((errno == EAGAIN) || (errno == EWOULDBLOCK)) && waitWritable()) continue;
+      fail();
+      break;
+    }
+
+    sent += rc;
+
+    // Step past what went out, which may end part way through a buffer
+    while ((n > 0) && ((size_t) rc >= v->iov_len)) {
+      rc -= v->iov_len;
+      v++;
+      n--;
+    }
+    if (n > 0) {
+      v->iov_base  = (uint8_t *) v->iov_base + rc;
+      v->iov_len  -= rc;
+    }
+  }
+
+  return sent;
+}
+
+boolean PosixClient::wait(boolean writable, unsigned long timeout) 
+{
+  if (_fd < 0) return false;
+
+  // Data already taken from the socket is ready to read without waiting
+  if (!writable && (_head < _tail)) return true;
+
+  struct pollfd p = { _fd, (short) (writable ? POLLOUT : POLLIN), 0 };
+  int           rc;
+
+  if (timeout > INT_MAX) timeout = INT_MAX;
+
+  do {
+    rc = poll(&p, 1, (int) timeout);
+  } while ((rc < 0) && (errno == EINTR));
+
+  return rc > 0;
+}
+
+// Waits up to the timeout for room to write. Returns false if there was none
+boolean PosixClient::waitWritable() 
+{
+  struct pollfd p = { _fd, POLLOUT, 0 };
+  int           rc;
+
+  do {
+    rc = poll(&p, 1, (int) _timeout);
+  } while ((rc < 0) && (errno == EINTR));
+
+  return (rc > 0) && !(p.revents & (POLLERR | POLLHUP | POLLNVAL));
+}
+
+// Reads what the socket has into the buffer, if it is empty. Returns the number of bytes buffered
+int PosixClient::fill() 
+{
+  if (_head < _tail) return _tail - _head;
+
+  _head = _tail = 0;
+
+  if (!connected() || _closed) return 0;
+
+  ssize_t rc;
+
+  do {
+    rc = recv(_fd, _buffer, sizeof(_buffer), 0);
+  } while ((rc < 0) && (errno == EINTR));
+
+  if (rc > 0) {
+    _tail = rc;
+  }
+  else if ((rc == 0) || ((errno != EAGAIN) && (errno != EWOULDBLOCK))) {
+    fail();
+  }
+
+  return _tail;
+}
+
+int PosixClient::available() 
+{
+  return fill();
+}
+
+int PosixClient::read() 
+{
+  if (fill() == 0) return -1;
+  return _buffer[_head++];
+}
+
+int PosixClient::read(uint8_t * buf, size_t size) 
+{
+  size_t n = fill();
+
+  if (n == 0) return -1;
+  if (n > size) n = size;
+
+  memcpy(buf, &_buffer[_head], n);
+  _head += n;
+
+  // Go on to whatever more the socket has for the rest
+  if (n < size) {
+    ssize_t rc = recv(_fd, buf + n, size - n, 0);
+
+    if (rc > 0) {
+      n += rc;
+    }
+    else if ((rc == 0) || ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))) {
+      fail();
+    }
+  }
+
+  return n;
+}
+
+int PosixClient::peek() 
+{
+  if (fill() == 0) return -1;
+  return _buffer[_head];
+}
+
+void PosixClient::flush() 
+{
+  // Writes have been handed to the kernel in full by the time they return
+}
+
+void PosixClient::stop() 
+{
+  if (_fd >= 0) close(_fd);
+
+  _fd     = -1;
+  _open   = false;
+  _closed = false;
+  _head   = _tail = 0;
+}
+
+// Marks the connection as gone, keeping anything already read until it has been consumed
+void PosixClient::fail() 
+{
+  _closed = true;
+}
+
+uint8_t PosixClient::connected() 
+{
+  if (_fd < 0) return 0;
+
+  // Whatever arrived before the connection closed can still be read
+  if (_closed) return _head < _tail;
+
+  if (!_open) {
+    struct pollfd p = { _fd, POLLOUT, 0 };
+
+    if (poll(&p, 1, 0) <= 0) return 0;
+
+    int       error  = 0;
+    socklen_t length = sizeof(error);
+
+    // A connection that could not be made leaves no socket, so the client is false
+    if ((getsockopt(_fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0) || (error != 0)) {
+      stop();
+      return 0;
+    }
+
+    _open = true;
+  }
+
+  return 1;
+}
+
+PosixClient::operator bool() 
+{
+  return _fd >= 0;
+}
+
+PosixClient & PosixClient::setNoDelay(boolean noDelay) 
+{
+  int on = noDelay ? 1 : 0;
+
+  _noDelay = noDelay;
+  if (_fd >= 0) setsockopt(_fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+  return *this;
+}
+
+PosixClient & PosixClient::setTimeout(unsigned long timeout) 
+{
+  _timeout = timeout;
+  return *this;
+}
+
+int PosixClient::fd() const 
+{
+  return _fd;
+}
+
+int PosixClient::buffered() const 
+{
+  return _tail - _head;
+}
+
+uint32_t PosixClient::connections() const 
+{
+  return _connections;
+}
@@ -0,0 +1,88 @@
+/*
+ PosixClient.h - A Client for PubSubClient over a non-blocking POSIX TCP socket.
+*/
+
+#ifndef PosixClient_h
+#define PosixClient_h
+
+#include "Arduino.h"
+#include "Client.h"
+#include "PubSubClient.h"
+
+// POSIX_CLIENT_BUFFER_SIZE : Bytes read from the socket at a time, and held until the client reads them
+#ifndef POSIX_CLIENT_BUFFER_SIZE
+  #define POSIX_CLIENT_BUFFER_SIZE 1024
+#endif
+
+// POSIX_CLIENT_TIMEOUT : Milliseconds a write waits, at most, for the socket to take more data
+#ifndef POSIX_CLIENT_TIMEOUT
+  #define POSIX_CLIENT_TIMEOUT 15000
+#endif
+
+// A TCP connection through a non-blocking socket. connect() returns as soon as the connection
+// is under way and connected() reports when it has opened, which is what
+// PubSubClient::beginConnect() needs to connect without blocking. Reads never block: available()
+// pulls whatever the socket has into a buffer of POSIX_CLIENT_BUFFER_SIZE bytes. Writes send as
+// much as the socket takes, waiting for it to drain when it is full, and writev() hands several
+// buffers to the kernel in one call. wait() blocks in poll(), for
+// PubSubClient::setWaitStrategy() to wait without spinning.
+class PosixClient : public Client, public VectoredClient, public WaitableClient {
+public:
+  PosixClient();
+  virtual ~PosixClient();
+
+  virtual int connect(IPAddress ip, uint16_t port);
+  // The name is resolved with getaddrinfo(), which blocks
+  virtual int connect(const char * host, uint16_t port);
+
+  virtual size_t write(uint8_t b);
+  virtual size_t write(const uint8_t * buf, size_t size);
+  virtual size_t writev(const MQTTIOVec * iov, uint8_t count);
+  virtual boolean wait(boolean writable, unsigned long timeout);
+
+  virtual int available();
+  virtual int read();
+  virtual int read(uint8_t * buf, size_t size);
+  virtual int peek();
+  virtual void flush();
+  virtual void stop();
+  virtual uint8_t connected();
+  virtual operator bool();
+
+  // Turn Nagle's algorithm off (the default) so small packets go out at once, or back on
+  // so the kernel may hold them to send with later ones
+  PosixClient & setNoDelay(boolean noDelay);
+
+  // Set how long a write waits for the socket to take more data before giving up, failing the
+  // connection. With 0 a write never waits
+  PosixClient & setTimeout(unsigned long timeout);
+
+  // The socket, or -1 if there is none, for waiting on it with poll() or epoll
+  int fd() const;
+
+  // The number of bytes already taken from the socket and waiting to be read. Waiting on
+  // the socket does not account for them
+  int buffered() const;
+
+  // The number of connections made so far, which tells a new socket from an old one that
+  // happens to have been given the same descriptor
+  uint32_t connections() const;
+
+private:
+  int           _fd;
+  boolean       _open;       // The connection has been established
+  boolean       _closed;     // The peer closed the connection, or it failed
+  boolean       _noDelay;
+  unsigned long _timeout;
+  uint32_t      _connections;
+  uint16_t      _head;
+  uint16_t      _tail;
+  uint8_t       _buffer[POSIX_CLIENT_BUFFER_SIZE];
+
+  int     open(const struct sockaddr * address, unsigned int length);
+  int     fill();
+  boolean waitWritable();
+  void    fail();
+};
+
+#endif
@@ -0,0 +1,114 @@
+/*
+ PublishQueue.cpp - Lets many threads publish through one PubSubClient without a lock.
+*/
+
+#include "PublishQueue.h"
+
+PublishQueue::PublishQueue(PublishSlot * slots, uint8_t * packets, uint16_t count, uint16_t size) :
+_slots(slots),
+_packets(packets),
+_mask(count - 1),
+_size(size),
+_head(0),
+_tail(0)
+{
+  for (uint32_t i = 0; i < count; i++) {
+    _slots[i].sequence.store(i, std::memory_order_relaxed);
+    _slots[i].length = 0;
+  }
+}
+
+boolean PublishQueue::publish(const char * topic, const uint8_t * payload, unsigned int plength, boolean retained)
+{
+  size_t   tlen      = strlen(topic);
+  uint32_t remaining = 2 + tlen + plength;
+  uint8_t  hlen      = 2;
+
+  for (uint32_t l = remaining; l >= 128; l >>= 7) {
+    hlen++;
+  }
+
+  if ((hlen + remaining) > _size) return false;
+
+  // Claim the next position, unless the consumer has yet to free its slot
+  uint32_t      pos = _head.load(std::memory_order_relaxed);
+  PublishSlot * slot;
+
+  while (true) {
+    slot = &_slots[pos & _mask];
+
+    int32_t turn = (int32_t) (slot->sequence.load(std::memory_order_acquire) - pos);
+
+    if (turn == 0) {
+      if (_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+    }
+    else if (turn < 0) {
+      return false;
+    }
+    else {
+      pos = _head.load(std::memory_order_relaxed);
+    }
+  }
+
+  uint8_t * packet = _packets + ((size_t) (pos & _mask) * _size);
+  uint16_t  length = 0;
+
+  packet[length++] = MQTTPUBLISH | (retained ? 1 : 0);
+
+  do {
+    uint8_t digit = remaining & 0x7F;
+    remaining >>= 7;
+    packet[length++] = (remaining > 0) ? (digit | 0x80) : digit;
+  } while (remaining > 0);
+
+  packet[length++] = tlen >> 8;
+  packet[length++] = tlen & 0xFF;
+  memcpy(packet + length, topic, tlen);
+  length += tlen;
+  memcpy(packet + length, payload, plength);
+  length += plength;
+
+  // Hand the slot to the consumer
+  slot->length = length;
+  slot->sequence.store(pos + 1, std::memory_order_release);
+
+  return true;
+}
+
+size_t PublishQueue::drain(PubSubClient & client)
+{
+  size_t  sent     = 0;
+  boolean batching = client.batching();
+
+  if (!client.connected()) return 0;
+
+  if (!batching) client.beginBatch();
+
+  while (sent <= _mask) {
+    uint32_t      pos  = _tail + sent;
+    PublishSlot * slot = &_slots[pos & _mask];
+
+    // Stop at a slot that is empty or still being filled
+    if (slot->sequence.load(std::memory_order_acquire) != (pos + 1)) break;
+
+    if (!client.publishFramed(_packets + ((size_t) (pos & _mask) * _size), slot->length)) break;
+
+    sent++;
+  }
+
+  // A batch of our own that fails to go out is sent again, whole, once reconnected. In the
+  // caller's batch, the messages are the caller's to flush
+  if (!batching && !client.flushBatch()) sent = 0;
+
+  // Free the slots sent for the producers one turn of the ring on
+  for (size_t i = 0; i < sent; i++, _tail++) {
+    _slots[_tail & _mask].sequence.store(_tail + _mask + 1, std::memory_order_release);
+  }
+
+  return sent;
+}
+
+size_t PublishQueue::size() const
+{
+  return _head.load(std::memory_order_relaxed) - _tail;
+}
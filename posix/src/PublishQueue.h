@@ -0,0 +1,78 @@
+/*
+ PublishQueue.h - Lets many threads publish through one PubSubClient without a lock.
+*/
+
+#ifndef PublishQueue_h
+#define PublishQueue_h
+
+#include <atomic>
+
+#include "Arduino.h"
+#include "PubSubClient.h"
+
+// One slot of a PublishQueue. Its sequence number tells producers and the consumer whose
+// turn it is: a producer may fill it for position p while it is p, and the consumer may
+// send it once the producer has made it p + 1
+struct PublishSlot {
+  std::atomic<uint32_t> sequence;
+  uint16_t              length;
+};
+
+// A bounded queue of QoS 0 publishes that any number of threads add to and the thread that
+// runs the client's loop() sends. Producers frame their packets straight into a slot of the
+// ring, after claiming it with a single compare-and-swap, so they never take a lock or wait
+// for the network: publish() returns false at once when the queue is full. drain() sends
+// everything queued as one batch. The ring has a power of two slots of size bytes each.
+class PublishQueue {
+public:
+  PublishQueue(PublishSlot * slots, uint8_t * packets, uint16_t count, uint16_t size);
+
+  // Queue a message for the client, from any thread
+  // Returns false if the queue is full or the packet would not fit in a slot
+  boolean publish(const char * topic, const uint8_t * payload, unsigned int plength, boolean retained = false);
+  inline boolean publish(const char * topic, const char * payload, boolean retained = false)
+  {
+    return publish(topic, (const uint8_t *) payload, strlen(payload), retained);
+  }
+
+  // Send what has been queued, in order, through client as one batch, from the thread that
+  // runs its loop(). Messages stay queued while the client is not connected, from the first
+  // the client refuses, and all of them if the batch fails to go out, in which case some may
+  // reach the server twice. If the caller has already begun a batch they join it, for the
+  // caller to flush, and otherwise the batch is flushed before returning. At most one ring's
+  // worth is sent per call, so busy producers cannot keep it from returning.
+  // Returns the number of messages taken from the queue
+  size_t drain(PubSubClient & client);
+
+  // The number of messages queued, or being queued, and not yet drained, from the thread that drains it
+  size_t size() const;
+
+private:
+  PublishSlot           * _slots;
+  uint8_t               * _packets;
+  uint32_t                _mask;
+  uint16_t                _size;
+
+  // The next position for a producer to claim, and for the consumer to send, each
+  // on a cache line of its own so producers and the consumer do not contend for it
+  alignas(64) std::atomic<uint32_t> _head;
+  alignas(64) uint32_t              _tail;
+};
+
+// The storage of a StaticPublishQueue, constructed ahead of the queue that uses it
+template<uint16_t N, uint16_t SIZE>
+struct PublishQueueStorage {
+  PublishSlot slots[N];
+  uint8_t     packets[N * SIZE];
+};
+
+// A PublishQueue that holds N messages of up to SIZE bytes each, framed
+template<uint16_t N, uint16_t SIZE = MQTT_MAX_PACKET_SIZE>
+class StaticPublishQueue : private PublishQueueStorage<N, SIZE>, public PublishQueue {
+  static_assert((N > 0) && ((N & (N - 1)) == 0), "A PublishQueue needs a power of two slots");
+
+public:
+  StaticPublishQueue() : PublishQueue(this->slots, this->packets, N, SIZE) {}
+};
+
+#endif
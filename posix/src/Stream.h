@@ -0,0 +1,14 @@
+#ifndef Stream_h
+#define Stream_h
+
+#include "Print.h"
+
+// Somewhere a received payload can be written as it arrives, see PubSubClient::setStream()
+class Stream : public Print {
+public:
+  virtual int available() { return 0; }
+  virtual int read() { return -1; }
+  virtual int peek() { return -1; }
+};
+
+#endif
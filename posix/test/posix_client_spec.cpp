@@ -0,0 +1,270 @@
+#include "PubSubClient.h"
+#include "PosixClient.h"
+#include "../../tests/src/lib/BDDTest.h"
+
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+
+char lastTopic[1024];
+char lastPayload[1024];
+unsigned int lastLength;
+
+void reset_callback() {
+    lastTopic[0] = '\0';
+    lastPayload[0] = '\0';
+    lastLength = 0;
+}
+
+void callback(char* topic, byte* payload, unsigned int length) {
+    strcpy(lastTopic,topic);
+    memcpy(lastPayload,payload,length);
+    lastLength = length;
+}
+
+// A listening socket on the loopback interface, on a port of its own
+int listen_loopback(uint16_t* port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in address;
+    socklen_t length = sizeof(address);
+
+    memset(&address,0,sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    bind(fd,(struct sockaddr*)&address,sizeof(address));
+    listen(fd,1);
+    getsockname(fd,(struct sockaddr*)&address,&length);
+    *port = ntohs(address.sin_port);
+    return fd;
+}
+
+// Reads exactly length bytes, giving up after a second
+bool read_exactly(int fd, uint8_t* buf, size_t length) {
+    struct timeval timeout = { 1, 0 };
+    setsockopt(fd,SOL_SOCKET,SO_RCVTIMEO,&timeout,sizeof(timeout));
+
+    size_t got = 0;
+    while (got < length) {
+        ssize_t rc = recv(fd,buf + got,length - got,0);
+        if (rc <= 0) return false;
+        got += rc;
+    }
+    return true;
+}
+
+// Runs the client until it is no longer connecting, for at most a second
+void finish_connecting(PubSubClient& client) {
+    for (int i = 0; (i < 1000) && client.connecting(); i++) {
+        client.loop();
+        usleep(1000);
+    }
+}
+
+int test_posix_connect_publish_receive() {
+    IT("connects, publishes and receives over a loopback socket");
+    reset_callback();
+    uint16_t port;
+    int server = listen_loopback(&port);
+
+    PosixClient posixClient;
+    PubSubClient client(IPAddress(127,0,0,1), port, callback, posixClient);
+
+    int rc = client.beginConnect("client_test1");
+    IS_TRUE(rc);
+
+    int peer = accept(server,NULL,NULL);
+    IS_TRUE(peer >= 0);
+
+    uint8_t connect[26];
+    byte expectConnect[] = {0x10,0x18,0x0,0x4,0x4d,0x51,0x54,0x54,0x4,0x2,0x0,0xf,0x0,0xc,0x63,0x6c,0x69,0x65,0x6e,0x74,0x5f,0x74,0x65,0x73,0x74,0x31};
+    for (int i = 0; (i < 1000) && (client.state() == MQTT_CONNECTING); i++) {
+        client.loop();
+        usleep(1000);
+    }
+    IS_TRUE(read_exactly(peer,connect,26));
+    IS_TRUE(memcmp(connect,expectConnect,26) == 0);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    send(peer,connack,4,0);
+
+    finish_connecting(client);
+    IS_TRUE(client.connected());
+    IS_TRUE(client.state() == MQTT_CONNECTED);
+
+    rc = client.publish("topic","payload");
+    IS_TRUE(rc);
+
+    uint8_t publish[16];
+    byte expectPublish[] = {0x30,0xe,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    IS_TRUE(read_exactly(peer,publish,16));
+    IS_TRUE(memcmp(publish,expectPublish,16) == 0);
+
+    send(peer,expectPublish,16,0);
+    for (int i = 0; (i < 1000) && (lastLength == 0); i++) {
+        client.loop();
+        usleep(1000);
+    }
+    IS_TRUE(strcmp(lastTopic,"topic") == 0);
+    IS_TRUE(memcmp(lastPayload,"payload",7) == 0);
+    IS_TRUE(lastLength == 7);
+
+    close(peer);
+    close(server);
+
+    END_IT
+}
+
+int test_posix_large_write() {
+    IT("writes more than the socket takes at once");
+    uint16_t port;
+    int server = listen_loopback(&port);
+
+    PosixClient posixClient;
+    int rc = posixClient.connect(IPAddress(127,0,0,1),port);
+    IS_TRUE(rc);
+
+    int peer = accept(server,NULL,NULL);
+    IS_TRUE(peer >= 0);
+
+    const size_t size = 4 * 1024 * 1024;
+    uint8_t* data = (uint8_t*) malloc(size);
+    for (size_t i = 0; i < size; i++) {
+        data[i] = (uint8_t) (i * 7);
+    }
+
+    // Read it all back while the client writes
+    bool same = true;
+    std::thread reader([&]() {
+        uint8_t buf[4096];
+        size_t got = 0;
+        while (got < size) {
+            ssize_t n = recv(peer,buf,sizeof(buf),0);
+            if (n <= 0) break;
+            for (ssize_t i = 0; i < n; i++) {
+                if (buf[i] != data[got + i]) same = false;
+            }
+            got += n;
+        }
+        if (got != size) same = false;
+    });
+
+    MQTTIOVec iov[3] = { { data, 1000 }, { data + 1000, size - 2000 }, { data + size - 1000, 1000 } };
+    size_t written = posixClient.writev(iov,3);
+
+    reader.join();
+    IS_TRUE(written == size);
+    IS_TRUE(same);
+
+    free(data);
+    close(peer);
+    close(server);
+
+    END_IT
+}
+
+int test_posix_refused() {
+    IT("reports a connection the server refuses");
+    uint16_t port;
+    int server = listen_loopback(&port);
+    close(server);
+
+    PosixClient posixClient;
+    PubSubClient client(IPAddress(127,0,0,1), port, callback, posixClient);
+
+    client.beginConnect("client_test1");
+    finish_connecting(client);
+
+    IS_FALSE(client.connected());
+    IS_TRUE(client.state() == MQTT_CONNECT_FAILED);
+
+    END_IT
+}
+
+int test_posix_closed_by_server() {
+    IT("reads what arrived before the server closed the connection");
+    uint16_t port;
+    int server = listen_loopback(&port);
+
+    PosixClient posixClient;
+    int rc = posixClient.connect(IPAddress(127,0,0,1),port);
+    IS_TRUE(rc);
+
+    int peer = accept(server,NULL,NULL);
+    send(peer,"abc",3,0);
+    close(peer);
+
+    uint8_t buf[8];
+    int n = 0;
+    for (int i = 0; (i < 1000) && (n < 3); i++) {
+        if (posixClient.available()) {
+            int r = posixClient.read(buf + n, sizeof(buf) - n);
+            if (r > 0) n += r;
+        }
+        usleep(1000);
+    }
+    IS_TRUE(n == 3);
+    IS_TRUE(memcmp(buf,"abc",3) == 0);
+
+    for (int i = 0; (i < 1000) && posixClient.connected(); i++) {
+        posixClient.available();
+        usleep(1000);
+    }
+    IS_FALSE(posixClient.connected());
+
+    close(server);
+
+    END_IT
+}
+
+int test_posix_blocking_connect() {
+    IT("waits for the CONNACK in poll() rather than spinning");
+    uint16_t port;
+    int server = listen_loopback(&port);
+
+    PosixClient posixClient;
+    PubSubClient client(IPAddress(127,0,0,1), port, callback, posixClient);
+    client.setWaitStrategy(posixClient);
+
+    // The server takes its time to answer
+    std::thread broker([&]() {
+        int peer = accept(server,NULL,NULL);
+        uint8_t connect[26];
+        read_exactly(peer,connect,26);
+        usleep(300000);
+        byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+        send(peer,connack,4,0);
+        usleep(100000);
+        close(peer);
+    });
+
+    clock_t cpu = clock();
+    int rc = client.connect("client_test1");
+    cpu = clock() - cpu;
+
+    broker.join();
+    IS_TRUE(rc);
+    IS_TRUE(client.state() == MQTT_CONNECTED);
+    IS_TRUE(cpu < CLOCKS_PER_SEC / 20);
+
+    close(server);
+
+    END_IT
+}
+
+int main()
+{
+    SUITE("POSIX client");
+
+    test_posix_connect_publish_receive();
+    test_posix_large_write();
+    test_posix_refused();
+    test_posix_closed_by_server();
+    test_posix_blocking_connect();
+
+    FINISH
+}
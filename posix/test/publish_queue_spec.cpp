@@ -0,0 +1,259 @@
+#include "PubSubClient.h"
+#include "PosixClient.h"
+#include "PublishQueue.h"
+#include "../../tests/src/lib/BDDTest.h"
+
+#include <stdio.h>
+#include <atomic>
+#include <thread>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define PRODUCERS 4
+#define MESSAGES  5000
+
+void callback(char* topic, byte* payload, unsigned int length) {
+}
+
+int listen_loopback(uint16_t* port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in address;
+    socklen_t length = sizeof(address);
+
+    memset(&address,0,sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    bind(fd,(struct sockaddr*)&address,sizeof(address));
+    listen(fd,1);
+    getsockname(fd,(struct sockaddr*)&address,&length);
+    *port = ntohs(address.sin_port);
+    return fd;
+}
+
+bool read_exactly(int fd, uint8_t* buf, size_t length) {
+    struct timeval timeout = { 2, 0 };
+    setsockopt(fd,SOL_SOCKET,SO_RCVTIMEO,&timeout,sizeof(timeout));
+
+    size_t got = 0;
+    while (got < length) {
+        ssize_t rc = recv(fd,buf + got,length - got,0);
+        if (rc <= 0) return false;
+        got += rc;
+    }
+    return true;
+}
+
+// Connects the client to the server, returning the server side of the connection
+int connect_loopback(int server, PubSubClient& client) {
+    int peer = -1;
+    std::thread broker([&]() {
+        peer = accept(server,NULL,NULL);
+        uint8_t connect[26];
+        read_exactly(peer,connect,26);
+        byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+        send(peer,connack,4,0);
+    });
+
+    client.connect("client_test1");
+    broker.join();
+    return peer;
+}
+
+// Reads one PUBLISH, returning its remaining length, or -1
+int read_publish(int fd, uint8_t* header, uint8_t* body) {
+    int length = 0;
+    int shift = 0;
+    uint8_t digit;
+
+    if (!read_exactly(fd,header,1)) return -1;
+    do {
+        if (!read_exactly(fd,&digit,1)) return -1;
+        length += (digit & 0x7F) << shift;
+        shift += 7;
+    } while (digit & 0x80);
+
+    if (!read_exactly(fd,body,length)) return -1;
+    return length;
+}
+
+int test_queue_frames_publish() {
+    IT("frames a queued message as publish() would");
+    uint16_t port;
+    int server = listen_loopback(&port);
+
+    PosixClient posixClient;
+    PubSubClient client(IPAddress(127,0,0,1), port, callback, posixClient);
+    client.setWaitStrategy(posixClient);
+    int peer = connect_loopback(server,client);
+    IS_TRUE(client.connected());
+
+    StaticPublishQueue<8> queue;
+    IS_TRUE(queue.publish("topic","payload"));
+    IS_TRUE(queue.publish("topic","payload",true));
+    IS_TRUE(queue.size() == 2);
+
+    IS_TRUE(queue.drain(client) == 2);
+    IS_TRUE(queue.size() == 0);
+
+    uint8_t publish[32];
+    byte expectPublish[] = {0x30,0xe,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    IS_TRUE(read_exactly(peer,publish,32));
+    IS_TRUE(memcmp(publish,expectPublish,16) == 0);
+    expectPublish[0] = 0x31;
+    IS_TRUE(memcmp(publish + 16,expectPublish,16) == 0);
+
+    close(peer);
+    close(server);
+
+    END_IT
+}
+
+int test_queue_joins_batch() {
+    IT("leaves a batch the caller began for the caller to flush");
+    uint16_t port;
+    int server = listen_loopback(&port);
+
+    PosixClient posixClient;
+    PubSubClient client(IPAddress(127,0,0,1), port, callback, posixClient);
+    client.setWaitStrategy(posixClient);
+    int peer = connect_loopback(server,client);
+    IS_TRUE(client.connected());
+
+    StaticPublishQueue<8> queue;
+    IS_TRUE(queue.publish("topic","payload"));
+
+    client.beginBatch();
+    IS_TRUE(queue.drain(client) == 1);
+    IS_TRUE(client.batching());
+
+    // Nothing has gone out until the caller flushes
+    uint8_t publish[16];
+    IS_TRUE(recv(peer,publish,16,MSG_DONTWAIT) < 0);
+
+    IS_TRUE(client.flushBatch());
+    IS_FALSE(client.batching());
+    IS_TRUE(read_exactly(peer,publish,16));
+    IS_TRUE(publish[0] == 0x30);
+
+    close(peer);
+    close(server);
+
+    END_IT
+}
+
+int test_queue_full() {
+    IT("refuses messages at once when full or too large for a slot");
+
+    PosixClient posixClient;
+    PubSubClient client(IPAddress(127,0,0,1), 1883, callback, posixClient);
+
+    StaticPublishQueue<4,32> queue;
+    char payload[32];
+    memset(payload,'x',sizeof(payload) - 1);
+    payload[sizeof(payload) - 1] = '\0';
+
+    IS_FALSE(queue.publish("topic",payload));
+
+    for (int i = 0; i < 4; i++) {
+        IS_TRUE(queue.publish("topic","payload"));
+    }
+    IS_FALSE(queue.publish("topic","payload"));
+    IS_TRUE(queue.size() == 4);
+
+    // Nothing is taken while the client is not connected
+    IS_TRUE(queue.drain(client) == 0);
+    IS_TRUE(queue.size() == 4);
+
+    END_IT
+}
+
+int test_queue_many_producers() {
+    IT("sends the messages of many producer threads, each in order");
+    uint16_t port;
+    int server = listen_loopback(&port);
+
+    PosixClient posixClient;
+    PubSubClient client(IPAddress(127,0,0,1), port, callback, posixClient);
+    client.setWaitStrategy(posixClient);
+    int peer = connect_loopback(server,client);
+    IS_TRUE(client.connected());
+
+    StaticPublishQueue<64> queue;
+
+    // The server checks each producer's messages arrive in the order they were queued
+    int received = 0;
+    bool ordered = true;
+    std::thread broker([&]() {
+        int next[PRODUCERS] = { 0 };
+        uint8_t header;
+        uint8_t body[64];
+        while (received < PRODUCERS * MESSAGES) {
+            int length = read_publish(peer,&header,body);
+            if (length < 0) break;
+            body[length] = '\0';
+
+            int producer, sequence;
+            if ((header != 0x30) || (sscanf((char*)body + 2 + 5,"%d:%d",&producer,&sequence) != 2) ||
+                (producer < 0) || (producer >= PRODUCERS) || (sequence != next[producer])) {
+                ordered = false;
+                break;
+            }
+            next[producer]++;
+            received++;
+        }
+    });
+
+    std::atomic<bool> stopped(false);
+    std::thread producers[PRODUCERS];
+    for (int p = 0; p < PRODUCERS; p++) {
+        producers[p] = std::thread([&queue, &stopped, p]() {
+            char payload[32];
+            for (int i = 0; i < MESSAGES; i++) {
+                sprintf(payload,"%d:%d",p,i);
+                // A full queue is reported at once, so the producer decides what to do
+                while (!queue.publish("topic",payload)) {
+                    if (stopped) return;
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+
+    // The client's own thread drains the queue, for at most ten seconds
+    size_t drained = 0;
+    unsigned long start = millis();
+    while ((drained < PRODUCERS * MESSAGES) && ((millis() - start) < 10000)) {
+        drained += queue.drain(client);
+        client.loop();
+    }
+    stopped = true;
+
+    for (int p = 0; p < PRODUCERS; p++) {
+        producers[p].join();
+    }
+    broker.join();
+
+    IS_TRUE(drained == PRODUCERS * MESSAGES);
+    IS_TRUE(ordered);
+    IS_TRUE(received == PRODUCERS * MESSAGES);
+
+    close(peer);
+    close(server);
+
+    END_IT
+}
+
+int main()
+{
+    SUITE("Publish queue");
+
+    test_queue_frames_publish();
+    test_queue_joins_batch();
+    test_queue_full();
+    test_queue_many_producers();
+
+    FINISH
+}
@@ -0,0 +1,348 @@
+#include "PubSubClient.h"
+#include "PosixClient.h"
+#include "EpollReactor.h"
+#include "../../tests/src/lib/BDDTest.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define CLIENTS 200
+
+int callbackCount = 0;
+char lastTopic[64];
+
+void reset_callback() {
+    callbackCount = 0;
+    lastTopic[0] = '\0';
+}
+
+void callback(char* topic, byte* payload, unsigned int length) {
+    callbackCount++;
+    strcpy(lastTopic,topic);
+}
+
+int listen_loopback(uint16_t* port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in address;
+    socklen_t length = sizeof(address);
+
+    memset(&address,0,sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    bind(fd,(struct sockaddr*)&address,sizeof(address));
+    listen(fd,CLIENTS);
+    getsockname(fd,(struct sockaddr*)&address,&length);
+    *port = ntohs(address.sin_port);
+    return fd;
+}
+
+bool read_exactly(int fd, uint8_t* buf, size_t length, int seconds = 1) {
+    struct timeval timeout = { seconds, 0 };
+    setsockopt(fd,SOL_SOCKET,SO_RCVTIMEO,&timeout,sizeof(timeout));
+
+    size_t got = 0;
+    while (got < length) {
+        ssize_t rc = recv(fd,buf + got,length - got,0);
+        if (rc <= 0) return false;
+        got += rc;
+    }
+    return true;
+}
+
+// Runs the reactor until every client has left the given state, for at most two seconds
+bool run_while(EpollReactor& reactor, PubSubClient* clients, int count, int state) {
+    for (int i = 0; i < 200; i++) {
+        bool left = true;
+        for (int c = 0; c < count; c++) {
+            if (clients[c].state() == state) left = false;
+        }
+        if (left) return true;
+        reactor.run(10);
+    }
+    return false;
+}
+
+// Connects count clients through the reactor, returning the server side of each
+bool connect_all(EpollReactor& reactor, int server, uint16_t port, PosixClient* sockets, PubSubClient* clients, char (*ids)[16], int* peers, int count) {
+    for (int c = 0; c < count; c++) {
+        sprintf(ids[c],"client_%d",c);
+        clients[c].setServer(IPAddress(127,0,0,1), port).setCallback(callback).setClient(sockets[c]);
+        if (!clients[c].beginConnect(ids[c])) return false;
+        if (!reactor.add(clients[c], sockets[c])) return false;
+    }
+
+    if (!run_while(reactor, clients, count, MQTT_CONNECTING)) return false;
+
+    // Match each connection to its client by the id in its CONNECT
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    for (int c = 0; c < count; c++) {
+        int peer = accept(server,NULL,NULL);
+        uint8_t connect[32];
+        int index;
+
+        if (!read_exactly(peer,connect,2)) return false;
+        if (!read_exactly(peer,connect + 2,connect[1])) return false;
+        connect[2 + connect[1]] = 0;
+        if (sscanf((char*)connect + 14,"client_%d",&index) != 1) return false;
+
+        peers[index] = peer;
+        send(peer,connack,4,0);
+    }
+
+    return run_while(reactor, clients, count, MQTT_CONNECT_SENT);
+}
+
+int test_reactor_runs_ready_clients() {
+    IT("runs only the clients with something to do");
+    reset_callback();
+    uint16_t port;
+    int server = listen_loopback(&port);
+
+    static PosixClient sockets[CLIENTS];
+    static PubSubClient clients[CLIENTS];
+    static char ids[CLIENTS][16];
+    static int peers[CLIENTS];
+    EpollReactor reactor;
+
+    IS_TRUE(connect_all(reactor, server, port, sockets, clients, ids, peers, CLIENTS));
+    IS_TRUE(reactor.size() == CLIENTS);
+
+    for (int c = 0; c < CLIENTS; c++) {
+        IS_TRUE(clients[c].connected());
+    }
+
+    // Nothing to do while they are idle
+    IS_TRUE(reactor.run(0) == 0);
+    IS_TRUE(reactor.run(50) == 0);
+
+    byte publish[] = {0x30,0x9,0x0,0x4,'c','/','3','7','a','b','c'};
+    send(peers[37],publish,sizeof(publish),0);
+
+    int run = 0;
+    for (int i = 0; (i < 100) && (callbackCount == 0); i++) {
+        run += reactor.run(10);
+    }
+    IS_TRUE(callbackCount == 1);
+    IS_TRUE(strcmp(lastTopic,"c/37") == 0);
+    IS_TRUE(run == 1);
+
+    // Two packets read together are both handled
+    byte twice[] = {0x30,0x9,0x0,0x4,'c','/','9','9','a','b','c',0x30,0x9,0x0,0x4,'c','/','9','8','a','b','c'};
+    send(peers[98],twice,sizeof(twice),0);
+
+    for (int i = 0; (i < 100) && (callbackCount < 3); i++) {
+        reactor.run(10);
+    }
+    IS_TRUE(callbackCount == 3);
+    IS_TRUE(strcmp(lastTopic,"c/98") == 0);
+
+    // A client removed is no longer run
+    reactor.remove(clients[5]);
+    IS_TRUE(reactor.size() == CLIENTS - 1);
+    send(peers[5],publish,sizeof(publish),0);
+    reactor.run(100);
+    IS_TRUE(callbackCount == 3);
+
+    for (int c = 0; c < CLIENTS; c++) {
+        reactor.remove(clients[c]);
+        close(peers[c]);
+    }
+    close(server);
+
+    END_IT
+}
+
+int test_reactor_keepalive() {
+    IT("runs an idle client when its keepalive is due (takes 16 seconds)");
+    uint16_t port;
+    int server = listen_loopback(&port);
+
+    PosixClient sockets[1];
+    PubSubClient clients[1];
+    char ids[1][16];
+    int peers[1];
+    EpollReactor reactor;
+
+    IS_TRUE(connect_all(reactor, server, port, sockets, clients, ids, peers, 1));
+
+    unsigned long start = millis();
+    int run = 0;
+    uint8_t ping[2] = { 0, 0 };
+
+    while ((millis() - start) < ((MQTT_KEEPALIVE + 2) * 1000UL)) {
+        run += reactor.run(1000);
+        if (recv(peers[0],ping,2,MSG_DONTWAIT) == 2) break;
+    }
+
+    IS_TRUE(ping[0] == 0xC0);
+    IS_TRUE(ping[1] == 0x00);
+    IS_TRUE((millis() - start) >= (MQTT_KEEPALIVE * 1000UL - EPOLL_REACTOR_TICK));
+    IS_TRUE(run == 1);
+
+    reactor.remove(clients[0]);
+    close(peers[0]);
+    close(server);
+
+    END_IT
+}
+
+int test_reactor_reconnect() {
+    IT("follows a client onto a new socket when it reconnects");
+    reset_callback();
+    uint16_t port;
+    int server = listen_loopback(&port);
+
+    PosixClient sockets[1];
+    PubSubClient clients[1];
+    char ids[1][16];
+    int peers[1];
+    EpollReactor reactor;
+
+    IS_TRUE(connect_all(reactor, server, port, sockets, clients, ids, peers, 1));
+    clients[0].setAutoReconnect(true, 0, 0);
+
+    close(peers[0]);
+    for (int i = 0; (i < 100) && clients[0].connected(); i++) {
+        reactor.run(10);
+    }
+    IS_FALSE(clients[0].connected());
+
+    for (int i = 0; (i < 100) && (clients[0].state() != MQTT_CONNECT_SENT); i++) {
+        reactor.run(10);
+    }
+    IS_TRUE(clients[0].state() == MQTT_CONNECT_SENT);
+
+    int peer = accept(server,NULL,NULL);
+    uint8_t connect[32];
+    IS_TRUE(read_exactly(peer,connect,2));
+    IS_TRUE(read_exactly(peer,connect + 2,connect[1]));
+    IS_TRUE(connect[0] == 0x10);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    send(peer,connack,4,0);
+    for (int i = 0; (i < 100) && !clients[0].connected(); i++) {
+        reactor.run(10);
+    }
+    IS_TRUE(clients[0].connected());
+
+    byte publish[] = {0x30,0x9,0x0,0x4,'c','/','0','0','a','b','c'};
+    send(peer,publish,sizeof(publish),0);
+    for (int i = 0; (i < 100) && (callbackCount == 0); i++) {
+        reactor.run(10);
+    }
+    IS_TRUE(callbackCount == 1);
+
+    reactor.remove(clients[0]);
+    close(peer);
+    close(server);
+
+    END_IT
+}
+
+int test_reactor_reused_descriptor() {
+    IT("leaves alone a descriptor that another client's socket has been given");
+    reset_callback();
+    uint16_t port;
+    int server = listen_loopback(&port);
+
+    PosixClient sockets[2];
+    PubSubClient clients[2];
+    char ids[2][16];
+    int peers[2];
+    EpollReactor reactor;
+
+    IS_TRUE(connect_all(reactor, server, port, sockets, clients, ids, peers, 2));
+
+    // The second client reconnects on the descriptor the first one's socket had
+    int fd = sockets[0].fd();
+    sockets[0].stop();
+    clients[1].setAutoReconnect(true, 0, 0);
+    close(peers[1]);
+
+    for (int i = 0; (i < 100) && (clients[1].state() != MQTT_CONNECT_SENT); i++) {
+        reactor.run(10);
+    }
+    IS_TRUE(clients[1].state() == MQTT_CONNECT_SENT);
+    IS_TRUE(sockets[1].fd() == fd);
+
+    int peer = accept(server,NULL,NULL);
+    uint8_t connect[32];
+    IS_TRUE(read_exactly(peer,connect,2));
+    IS_TRUE(read_exactly(peer,connect + 2,connect[1]));
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    send(peer,connack,4,0);
+    for (int i = 0; (i < 100) && !clients[1].connected(); i++) {
+        reactor.run(10);
+    }
+    IS_TRUE(clients[1].connected());
+
+    // Removing the first client must not stop epoll watching the second
+    reactor.remove(clients[0]);
+
+    byte publish[] = {0x30,0x9,0x0,0x4,'c','/','0','1','a','b','c'};
+    send(peer,publish,sizeof(publish),0);
+    for (int i = 0; (i < 100) && (callbackCount == 0); i++) {
+        reactor.run(10);
+    }
+    IS_TRUE(callbackCount == 1);
+
+    reactor.remove(clients[1]);
+    close(peer);
+    close(peers[0]);
+    close(server);
+
+    END_IT
+}
+
+int test_reactor_write_timeout() {
+    IT("drops a client whose peer stops reading rather than waiting on it");
+    reset_callback();
+    uint16_t port;
+    int server = listen_loopback(&port);
+
+    PosixClient socket;
+    PubSubClient client;
+    char ids[1][16];
+    int peer;
+    EpollReactor reactor;
+
+    IS_TRUE(connect_all(reactor, server, port, &socket, &client, ids, &peer, 1));
+
+    // The peer reads nothing, so the socket fills up and the next write fails at once
+    char payload[200];
+    memset(payload,'x',sizeof(payload));
+    payload[sizeof(payload) - 1] = 0;
+
+    unsigned long start = millis();
+    int sent = 0;
+    while ((sent < 1000000) && client.publish("topic",payload)) {
+        sent++;
+    }
+    IS_TRUE(sent < 1000000);
+    IS_TRUE(millis() - start < 5000);
+    IS_FALSE(client.connected());
+
+    reactor.remove(client);
+    close(peer);
+    close(server);
+
+    END_IT
+}
+
+int main()
+{
+    SUITE("Reactor");
+
+    test_reactor_runs_ready_clients();
+    test_reactor_reconnect();
+    test_reactor_reused_descriptor();
+    test_reactor_write_timeout();
+    test_reactor_keepalive();
+
+    FINISH
+}
@@ -7,29 +7,92 @@
 #include "PubSubClient.h"
 #include "Arduino.h"
 
+// Parts of a packet the receive state machine can be part way through
+#define MQTT_RX_HEADER       0 // Fixed header byte
+#define MQTT_RX_LENGTH       1 // Remaining length field
+#define MQTT_RX_BODY         2 // Everything after the remaining length field
+
+// The qos remembered for a topic filter waiting to be unsubscribed from
+#define MQTT_SUB_REMOVE   0x80
+// Set on the qos of a topic filter sent in a request not yet acknowledged
+#define MQTT_SUB_SENT     0x40
+
 PubSubClient::PubSubClient() :
 _state(MQTT_DISCONNECTED),
 _client(nullptr),
+_vclient(nullptr),
+_wclient(nullptr),
+_waitStrategy(MQTT_WAIT_YIELD),
 _stream(nullptr),
-_callback(nullptr)
+_callback(nullptr),
+_messageCallback(nullptr),
+_publishCallback(nullptr),
+_subscribeCallback(nullptr),
+_connectCallback(nullptr),
+_reconnectCallback(nullptr),
+_router(nullptr),
+_topicTable(),
+_domain(nullptr),
+rxBuffer(nullptr),
+txBuffer(nullptr),
+rxBufferSize(MQTT_MAX_PACKET_SIZE),
+txBufferSize(MQTT_MAX_PACKET_SIZE),
+bufferOwned(false),
+_connectId(nullptr),
+_autoReconnect(false),
+_reconnectPending(false),
+_reconnectAttempts(0),
+_reconnectMin(MQTT_RECONNECT_MIN_DELAY),
+_reconnectMax(MQTT_RECONNECT_MAX_DELAY),
+_reconnectBackoff(MQTT_RECONNECT_MIN_DELAY),
+_rxState(MQTT_RX_HEADER),
+_txPos(0),
+_txFailed(false),
+_batching(false),
+_inflight(),
+_free(MQTT_INFLIGHT_MASK),
+_inbound(),
+_store(nullptr),
+_storeOwned(false),
+_subTopics(nullptr),
+_subQos(nullptr),
+_subCount(0),
+_subSize(0),
+_resubscribe(0),
+_window(MQTT_MAX_INFLIGHT),
+_lastMsgId(0)
 {
 }
 
 PubSubClient::PubSubClient(Client & client) :
-_state(MQTT_DISCONNECTED),
-_client(&client),
-_stream(nullptr),
-_callback(nullptr)
+PubSubClient()
+{
+  setClient(client);
+}
+
+PubSubClient::PubSubClient(Client  & client, 
+                           uint8_t * rxBuffer, 
+                           uint8_t * txBuffer, 
+                           uint16_t  size) :
+PubSubClient(client)
+{
+  setBuffer(rxBuffer, txBuffer, size);
+}
+
+PubSubClient::PubSubClient(Client  & client, 
+                           uint8_t * rxBuffer, 
+                           uint16_t  rxSize, 
+                           uint8_t * txBuffer, 
+                           uint16_t  txSize) :
+PubSubClient(client)
 {
+  setBuffer(rxBuffer, rxSize, txBuffer, txSize);
 }
 
 PubSubClient::PubSubClient(IPAddress addr, 
                            uint16_t  port, 
                            Client  & client) :
-_state(MQTT_DISCONNECTED),
-_client(&client),
-_stream(nullptr),
-_callback(nullptr)
+PubSubClient(client)
 {
   setServer(addr, port);
 }
@@ -38,24 +101,18 @@ PubSubClient::PubSubClient(IPAddress addr,
                            uint16_t  port, 
                            Client  & client, 
                            Stream  & stream) :
-_state(MQTT_DISCONNECTED),
-_client(&client),
-_stream(&stream),
-_callback(nullptr)
+PubSubClient(addr, port, client)
 {
-  setServer(addr, port);
+  setStream(stream);
 }
 
 PubSubClient::PubSubClient(IPAddress addr, 
                            uint16_t  port, 
                            MQTT_CALLBACK_SIGNATURE(callback), 
                            Client  & client) :
-_state(MQTT_DISCONNECTED),
-_client(&client),
-_stream(nullptr),
-_callback(callback)
+PubSubClient(addr, port, client)
 {
-  setServer(addr, port);
+  setCallback(callback);
 }
 
 PubSubClient::PubSubClient(IPAddress addr, 
@@ -63,21 +120,15 @@ PubSubClient::PubSubClient(IPAddress addr,
                            MQTT_CALLBACK_SIGNATURE(callback), 
                            Client & client, 
                            Stream & stream) :
-_state(MQTT_DISCONNECTED),
-_client(&client),
-_stream(&stream),
-_callback(callback)
+PubSubClient(addr, port, callback, client)
 {
-  setServer(addr, port);
+  setStream(stream);
 }
 
 PubSubClient::PubSubClient(uint8_t * ip, 
                            uint16_t  port, 
                            Client  & client) :
-_state(MQTT_DISCONNECTED),
-_client(&client),
-_stream(nullptr),
-_callback(nullptr)
+PubSubClient(client)
 {
   setServer(ip, port);
 }
@@ -86,24 +137,18 @@ PubSubClient::PubSubClient(uint8_t * ip,
                            uint16_t  port, 
                            Client  & client, 
                            Stream  & stream) :
-_state(MQTT_DISCONNECTED),
-_client(&client),
-_stream(&stream),
-_callback(nullptr)
+PubSubClient(ip, port, client)
 {
-  setServer(ip, port);
+  setStream(stream);
 }
 
 PubSubClient::PubSubClient(uint8_t * ip, 
                            uint16_t  port, 
                            MQTT_CALLBACK_SIGNATURE(callback), 
                            Client  & client) :
-_state(MQTT_DISCONNECTED),
-_client(&client),
-_stream(nullptr),
-_callback(callback)
+PubSubClient(ip, port, client)
 {
-  setServer(ip, port);
+  setCallback(callback);
 }
 
 PubSubClient::PubSubClient(uint8_t * ip, 
@@ -111,21 +156,15 @@ PubSubClient::PubSubClient(uint8_t * ip,
                            MQTT_CALLBACK_SIGNATURE(callback), 
                            Client  & client, 
                            Stream  & stream) :
-_state(MQTT_DISCONNECTED),
-_client(&client),
-_stream(&stream),
-_callback(callback)
+PubSubClient(ip, port, callback, client)
 {
-  setServer(ip, port);
+  setStream(stream);
 }
 
 PubSubClient::PubSubClient(const char * domain, 
                            uint16_t     port, 
                            Client     & client) :
-_state(MQTT_DISCONNECTED),
-_client(&client),
-_stream(nullptr),
-_callback(nullptr)
+PubSubClient(client)
 {
   setServer(domain, port);
 }
@@ -134,24 +173,18 @@ PubSubClient::PubSubClient(const char * domain,
                            uint16_t     port, 
                            Client     & client, 
                            Stream     & stream) :
-_state(MQTT_DISCONNECTED),
-_client(&client),
-_stream(&stream),
-_callback(nullptr)
+PubSubClient(domain, port, client)
 {
-  setServer(domain, port);
+  setStream(stream);
 }
 
 PubSubClient::PubSubClient(const char * domain, 
                            uint16_t     port, 
                            MQTT_CALLBACK_SIGNATURE(callback), 
                            Client     & client) :
-_state(MQTT_DISCONNECTED),
-_client(&client),
-_stream(nullptr),
-_callback(callback)
+PubSubClient(domain, port, client)
 {
-  setServer(domain, port);
+  setCallback(callback);
 }
 
 PubSubClient::PubSubClient(const char * domain, 
@@ -159,12 +192,21 @@ PubSubClient::PubSubClient(const char * domain,
                            MQTT_CALLBACK_SIGNATURE(callback), 
                            Client     & client, 
                            Stream     & stream) :
-_state(MQTT_DISCONNECTED),
-_client(&client),
-_stream(&stream),
-_callback(callback)
+PubSubClient(domain, port, callback, client)
 {
-  setServer(domain, port);
+  setStream(stream);
+}
+
+PubSubClient::~PubSubClient()
+{
+  if (bufferOwned) free(rxBuffer);
+  if (_storeOwned) free(_store);
+
+  for (uint16_t i = 0; i < _subCount; i++) {
+    free(_subTopics[i]);
+  }
+  free(_subTopics);
+  free(_subQos);
 }
 
 boolean PubSubClient::connect(const char * id, 
@@ -176,7 +218,101 @@ boolean PubSubClient::connect(const char * id,
                               const char * willMessage, 
                               boolean      cleanSession) 
 {
-  if (connected()) return true;
+  if (!beginConnect(id, user, pass, willTopic, willQos, willRetain, willMessage, cleanSession)) return false;
+
+  for (uint16_t polls = 0; connecting(); polls++) {
+    wait(polls);
+    continueConnect();
+  }
+
+  return _state == MQTT_CONNECTED;
+}
+
+boolean PubSubClient::beginConnect(const char * id, 
+                                   const char * user, 
+                                   const char * pass, 
+                                   const char * willTopic, 
+                                   uint8_t      willQos, 
+                                   boolean      willRetain, 
+                                   const char * willMessage, 
+                                   boolean      cleanSession) 
+{
+  if (connecting() || connected()) return true;
+
+  if ((rxBuffer == nullptr) && !setBufferSize(rxBufferSize, txBufferSize)) {
+    endConnect(MQTT_CONNECT_FAILED);
+    return false;
+  }
+
+  _connectId        = id;
+  _connectUser      = user;
+  _connectPass      = pass;
+  _willTopic        = willTopic;
+  _willQos          = willQos;
+  _willRetain       = willRetain;
+  _willMessage      = willMessage;
+  _cleanSession     = cleanSession;
+  _reconnectPending = false;
+
+  nextMsgId     = 1;
+  _rxState      = MQTT_RX_HEADER;
+  _txPos        = 0;
+  _batching     = false;
+  // Leave room in the buffer for header and variable length field
+  uint16_t length = MQTT_MAX_HEADER_SIZE;
+
+  #if MQTT_VERSION == MQTT_VERSION_3_1
+    uint8_t d[9] = { 0x00, 0x06, 'M', 'Q', 'I', 's', 'd', 'p', MQTT_VERSION };
+    #define MQTT_HEADER_VERSION_LENGTH 9
+  #elif MQTT_VERSION == MQTT_VERSION_3_1_1
+    uint8_t d[7] = { 0x00, 0x04, 'M', 'Q', 'T', 'T', MQTT_VERSION };
+    #define MQTT_HEADER_VERSION_LENGTH 7
+  #endif
+          
+  for (unsigned int i = 0; i < MQTT_HEADER_VERSION_LENGTH; i++) {
+    txBuffer[length++] = d[i];
+  }
+
+  uint8_t v;
+
+  if (willTopic != nullptr) {
+    v = 0x04 | (willQos << 3) | (willRetain << 5);
+  } 
+  else {
+    v = 0x00;
+  }
+
+  if (cleanSession) v = v | 0x02;
+
+  if (user != nullptr) {
+    v = v | 0x80;
+
+    if(pass != nullptr) {
+      v = v | (0x80 >> 1);
+    }
+  }
+
+  txBuffer[length++] = v;
+
+  txBuffer[length++] = (MQTT_KEEPALIVE) >> 8;
+  txBuffer[length++] = (MQTT_KEEPALIVE) & 0xFF;
+
+  if (!check_and_write(&length, id)) return false;
+
+  if (willTopic != nullptr) {
+    if (!check_and_write(&length, willTopic  )) return false;
+    if (!check_and_write(&length, willMessage)) return false;
+  }
+
+  if (user != nullptr) {
+    if (!check_and_write(&length, user)) return false;
+    if (pass != nullptr) {
+      if (!check_and_write(&length, pass)) return false;
+    }
+  }
+
+  // Staged until the network connection is open
+  stage(MQTTCONNECT, txBuffer, length, 0);
 
   boolean result;
 
@@ -187,189 +323,247 @@ boolean PubSubClient::connect(const char * id,
     result = _client->connect(_domain, _port);
   }
 
-  if (result) {
-    nextMsgId = 1;
-    // Leave room in the buffer for header and variable length field
-    uint16_t length = MQTT_MAX_HEADER_SIZE;
-
-    #if MQTT_VERSION == MQTT_VERSION_3_1
-      uint8_t d[9] = { 0x00, 0x06, 'M', 'Q', 'I', 's', 'd', 'p', MQTT_VERSION };
-      #define MQTT_HEADER_VERSION_LENGTH 9
-    #elif MQTT_VERSION == MQTT_VERSION_3_1_1
-      uint8_t d[7] = { 0x00, 0x04, 'M', 'Q', 'T', 'T', MQTT_VERSION };
-      #define MQTT_HEADER_VERSION_LENGTH 7
-    #endif
-            
-    for (unsigned int i = 0; i < MQTT_HEADER_VERSION_LENGTH; i++) {
-      buffer[length++] = d[i];
-    }
+  if (!result) {
+    _txPos = 0;
+    endConnect(MQTT_CONNECT_FAILED);
+    return false;
+  }
 
-    uint8_t v;
+  _state = MQTT_CONNECTING;
+  lastInActivity = lastOutActivity = millis();
 
-    if (willTopic != nullptr) {
-      v = 0x04 | (willQos << 3) | (willRetain << 5);
-    } 
-    else {
-      v = 0x00;
-    }
+  continueConnect();
 
-    if (cleanSession) v = v | 0x02;
+  return true;
+}
 
-    if (user != nullptr) {
-      v = v | 0x80;
+// Takes a connection attempt as far as it can go without waiting.
+// Returns true once it has connected
+boolean PubSubClient::continueConnect() 
+{
+  unsigned long t = millis();
 
-      if(pass != nullptr) {
-        v = v | (0x80 >> 1);
+  if (_state == MQTT_CONNECTING) {
+    if (!_client->connected()) {
+      // A client that is no longer valid gave up on the connection
+      if (!*_client) {
+        _txPos = 0;
+        endConnect(MQTT_CONNECT_FAILED);
       }
+      else if ((t - lastInActivity) > (MQTT_SOCKET_TIMEOUT * 1000UL)) {
+        _txPos = 0;
+        endConnect(MQTT_CONNECTION_TIMEOUT);
+      }
+      return false;
+    }
+
+    if (!flushBuffer()) {
+      endConnect(MQTT_CONNECT_FAILED);
+      return false;
     }
 
-    buffer[length++] = v;
+    _state = MQTT_CONNECT_SENT;
+    lastInActivity = lastOutActivity = t;
+  }
 
-    buffer[length++] = (MQTT_KEEPALIVE) >> 8;
-    buffer[length++] = (MQTT_KEEPALIVE) & 0xFF;
+  uint8_t  llen;
+  uint32_t len;
 
-    if (!check_and_write(&length, id)) return false;
- 
-    if (willTopic != nullptr) {
-      if (!check_and_write(&length, willTopic  )) return false;
-      if (!check_and_write(&length, willMessage)) return false;
+  if (!readAvailable(&len, &llen)) {
+    if ((t - lastInActivity) > (MQTT_SOCKET_TIMEOUT * 1000UL)) {
+      _rxState = MQTT_RX_HEADER;
+      endConnect(MQTT_CONNECTION_TIMEOUT);
     }
-
-    if (user != nullptr) {
-      if (!check_and_write(&length, user)) return false;
-      if (pass != nullptr) {
-        if (!check_and_write(&length, pass)) return false;
-      }
+    else if (!_client->connected()) {
+      endConnect(MQTT_CONNECT_FAILED);
     }
+    return false;
+  }
 
-    write(MQTTCONNECT, buffer, length - MQTT_MAX_HEADER_SIZE);
+  if (len != 4) {
+    endConnect(MQTT_CONNECT_FAILED);
+    return false;
+  }
 
-    lastInActivity = lastOutActivity = millis();
+  if (rxBuffer[3] != 0) {
+    endConnect(rxBuffer[3]);
+    return false;
+  }
 
-    while (!_client->available()) {
-      if ((millis() - lastInActivity) > (MQTT_SOCKET_TIMEOUT * 1000UL)) {
-        _state = MQTT_CONNECTION_TIMEOUT;
-        _client->stop();
-        return false;
-      }
-    }
+  lastInActivity = millis();
+  pingOutstanding = false;
+  _state = MQTT_CONNECTED;
 
-    uint8_t  llen;
-    uint32_t len = readPacket(&llen);
+  // Messages left waiting for acknowledgement are sent again if the server
+  // kept the session, otherwise they went with it, along with the subscriptions
+  if (!_cleanSession && (rxBuffer[2] & 0x01)) {
+    retransmit(lastInActivity, true);
+    requeueSubscriptions();
+  }
+  else {
+    endInflight(false);
+    memset(_inbound, 0, sizeof(_inbound));
 
-    if (len == 4) {
-      if (buffer[3] == 0) {
-        lastInActivity = millis();
-        pingOutstanding = false;
-        _state = MQTT_CONNECTED;
-        return true;
-      } 
+    // Nothing is left to unsubscribe from, and everything else is subscribed to again
+    for (uint16_t i = _subCount; i > 0; i--) {
+      if (_subQos[i - 1] & MQTT_SUB_REMOVE) {
+        removeSubscriptions(i - 1, 1);
+      }
       else {
-        _state = buffer[3];
+        _subQos[i - 1] &= ~MQTT_SUB_SENT;
       }
     }
-    _client->stop();
-  } 
-  else {
-    _state = MQTT_CONNECT_FAILED;
+    _resubscribe = 0;
   }
 
-  return false;
+  // Send whatever is waiting, as far as the in-flight window allows
+  resubscribe();
+
+  endConnect(MQTT_CONNECTED);
+
+  return true;
 }
 
-// reads a byte into result
-boolean PubSubClient::readByte(uint8_t * result) 
+// Waits, as the wait strategy has it, before the network client is polled again.
+// polls is the number of times it has been polled so far in this wait
+void PubSubClient::wait(uint16_t polls) 
 {
-  uint32_t previousMillis = millis();
-  while (!_client->available()) {
-    yield();
-    if ((millis() - previousMillis) > (MQTT_SOCKET_TIMEOUT * 1000UL)) {
-      return false;
-    }
+  if (_waitStrategy == MQTT_WAIT_SPIN) return;
+
+  if ((_waitStrategy == MQTT_WAIT_BLOCK) && _wclient) {
+    unsigned long timeout = nextDeadline();
+
+    // Until the connection opens there is nothing to read, only room to write the CONNECT
+    if (timeout > 0) _wclient->wait(_state == MQTT_CONNECTING, timeout);
+    return;
   }
-  *result = _client->read();
-  return true;
+
+  if (polls >= MQTT_WAIT_SPINS) yield();
 }
 
-// reads a byte into result[*index] and increments index
-boolean PubSubClient::readByte(uint8_t * result, uint16_t * index)
+// Records how a connection attempt ended, closing the network connection if it failed
+void PubSubClient::endConnect(int state) 
 {
-  if (readByte(&result[*index])) {
-    *index += 1;
-    return true;
+  _state = state;
+
+  if (state != MQTT_CONNECTED) {
+    _client->stop();
   }
-  return false;
+  else {
+    _reconnectAttempts = 0;
+    _reconnectBackoff  = _reconnectMin;
+  }
+
+  if (_connectCallback) _connectCallback(state);
 }
 
-uint32_t PubSubClient::readPacket(uint8_t * lengthLength) 
+// Consumes whatever the client already has available towards the next packet,
+// picking up where the previous call left off. Returns true once a whole packet
+// has been consumed, setting length to its size in the buffer (0 if it had to
+// be dropped). Returns false if the packet is still incomplete.
+boolean PubSubClient::readAvailable(uint32_t * length, uint8_t * lengthLength)
 {
-  uint16_t len = 0;
+  int available;
 
-  if (!readByte(buffer, &len)) return 0;
-    
-  bool isPublish = (buffer[0] & 0xF0) == MQTTPUBLISH;
-    
-  uint32_t shift      = 0;
-  uint32_t length     = 0;
-  uint16_t skip       = 0;
-  uint8_t  digit      = 0;
-  uint8_t  start      = 0;
+  while ((available = _client->available()) > 0) {
 
-  do {
-    if (len >= 5) { // Cannot be larger than 4 bytes, including buffer type
-      // Invalid remaining length encoding - kill the connection
-      _state = MQTT_DISCONNECTED;
-      _client->stop();
-      return 0;
-    }
-    
-    if (!readByte(&digit)) return 0;
+    if (_rxState == MQTT_RX_HEADER || _rxState == MQTT_RX_LENGTH) {
+      int digit = _client->read();
+      if (digit < 0) break;
 
-    buffer[len++] = digit;
-    length += (digit & 0x7F) << shift;
-    shift  += 7;
-  } while ((digit & 0x80) != 0);
+      lastInActivity = millis();
 
-  *lengthLength = len - 1;
+      if (_rxState == MQTT_RX_HEADER) {
+        rxBuffer[0] = digit;
+        _rxPos    = 1;
+        _rxLength = 0;
+        _rxShift  = 0;
+        _rxRead   = 0;
+        _rxState  = MQTT_RX_LENGTH;
+        continue;
+      }
 
-  if (isPublish) {
-    // Read in topic length to calculate bytes to skip over for Stream writing
-    if (!readByte(buffer, &len)) return 0;
-    if (!readByte(buffer, &len)) return 0;
-    skip = (buffer[*lengthLength + 1] << 8) + buffer[*lengthLength + 2];
-    start = 2;
-    if (buffer[0] & MQTTQOS1) {
-      // skip message id
-      skip += 2;
-    }
-  }
+      if (_rxPos >= 5) { // Cannot be larger than 4 bytes, including buffer type
+        // Invalid remaining length encoding - kill the connection, which counts as losing
+        // it rather than as disconnect(), so automatic reconnection carries on
+        _rxState = MQTT_RX_HEADER;
+        _state   = MQTT_CONNECTION_LOST;
+        _client->stop();
+        *length = 0;
+        return true;
+      }
+
+      rxBuffer[_rxPos++] = digit;
+      _rxLength += (uint32_t) (digit & 0x7F) << _rxShift;
+      _rxShift  += 7;
+
+      if (digit & 0x80) continue;
+
+      _rxLengthLength = _rxPos - 1;
+      _rxState        = MQTT_RX_BODY;
+    } 
+    else {
+      // Pull as much of the body as is available in one read, straight into the
+      // buffer while it fits and through a scratch area after that
+      uint32_t  n = _rxLength - _rxRead;
+      uint8_t   chunk[32];
+      uint8_t * dest;
+
+      if (n > (uint32_t) available) n = available;
+
+      if (_rxPos < rxBufferSize) {
+        dest = &rxBuffer[_rxPos];
+        if (n > (uint32_t) (rxBufferSize - _rxPos)) n = rxBufferSize - _rxPos;
+      } 
+      else {
+        dest = chunk;
+        if (n > sizeof(chunk)) n = sizeof(chunk);
+      }
+
+      int rc = _client->read(dest, n);
+      if (rc <= 0) break;
 
-  uint32_t idx = len;
+      lastInActivity = millis();
 
-  for (uint32_t i = start; i < length; i++) {
-    if (!readByte(&digit)) return 0;
-    if (_stream) {
-      if (isPublish && ((idx - *lengthLength - 2) > skip)) {
-        _stream->write(digit);
+      // Once the topic length has arrived, whatever was read from the payload on is
+      // forwarded: the payload follows the topic and, with QoS 1 or 2, the message id
+      if (_stream && ((rxBuffer[0] & 0xF0) == MQTTPUBLISH) && ((_rxRead + rc) >= 2)) {
+        uint32_t payload = 2 + (rxBuffer[_rxLengthLength + 1] << 8) + rxBuffer[_rxLengthLength + 2];
+
+        if (rxBuffer[0] & 0x06) payload += 2;
+
+        for (uint32_t i = (_rxRead > payload) ? _rxRead : payload; i < (_rxRead + rc); i++) {
+          _stream->write(dest[i - _rxRead]);
+        }
       }
+
+      if (dest != chunk) _rxPos += rc;
+      _rxRead += rc;
     }
-    if (len < MQTT_MAX_PACKET_SIZE) {
-      buffer[len] = digit;
-      len++;
-    }
-    idx++;
-  }
 
-  if (!_stream && (idx > MQTT_MAX_PACKET_SIZE)) {
-    len = 0; // This will cause the packet to be ignored.
+    if ((_rxState == MQTT_RX_BODY) && (_rxRead >= _rxLength)) {
+      *lengthLength = _rxLengthLength;
+      *length       = _rxPos;
+      _rxState      = MQTT_RX_HEADER;
+
+      if (!_stream && ((1 + _rxLengthLength + _rxLength) > rxBufferSize)) {
+        *length = 0; // This will cause the packet to be ignored.
+      }
+      return true;
+    }
   }
 
-  return len;
+  return false;
 }
 
 boolean PubSubClient::loop() 
 {
-  if (!connected()) return false;
+  if (connecting()) return continueConnect();
+
+  if (!connected()) {
+    if (_autoReconnect) reconnect();
+    return false;
+  }
 
   unsigned long t = millis();
 
@@ -382,66 +576,156 @@ boolean PubSubClient::loop()
       return false;
     } 
     else {
-      buffer[0] = MQTTPINGREQ;
-      buffer[1] = 0;
-      _client->write(buffer, 2);
+      // The keepalive goes out at once, along with anything batched ahead of it
+      uint8_t packet[2] = { MQTTPINGREQ, 0 };
+      writeControl(packet, 2);
+      flushBuffer();
       lastOutActivity = t;
       lastInActivity  = t;
       pingOutstanding = true;
     }
   }
 
-  if (_client->available()) {
+  retransmit(t, false);
+
+  uint8_t   llen;
+  uint32_t  len;
+
+  if (readAvailable(&len, &llen)) {
 
-    uint8_t   llen;
-    uint32_t  len   = readPacket(&llen);
     uint16_t  msgId = 0;
     uint8_t * payload;
 
     if (len > 0) {
-      lastInActivity = t;
-      uint8_t type = buffer[0] & 0xF0;
+      uint8_t type = rxBuffer[0] & 0xF0;
       if (type == MQTTPUBLISH) {
 
-        if (_callback) {
-          uint16_t tl = (buffer[llen + 1] << 8) + buffer[llen + 2]; // topic length in bytes
-          memmove(&buffer[llen + 2], &buffer[llen + 3], tl);        // move topic inside buffer 1 byte to front
-          buffer[llen + 2 + tl] = 0;                                // end the topic as a 'C' string with \x00
-          char * topic = (char*) &buffer[llen + 2];
-
-          // msgId only present for QOS > 0
-          if ((buffer[0] & 0x06) == MQTTQOS1) {
-            msgId   = (buffer[llen + 3 + tl] << 8) + buffer[llen + 3 + tl + 1];
-            payload = &buffer[llen + 3 + tl + 2];
-            _callback(topic, payload, len - llen - 3 - tl - 2);
-
-            buffer[0] = MQTTPUBACK;
-            buffer[1] = 2;
-            buffer[2] = (msgId >> 8);
-            buffer[3] = (msgId & 0xFF);
-            _client->write(buffer, 4);
-            lastOutActivity = t;
-
-          } 
+        // The topic length must have been received before it is read
+        if (len < (uint32_t) (llen + 3)) return true;
+
+        uint8_t  qos      = (rxBuffer[0] & 0x06) >> 1;
+        boolean  retained = rxBuffer[0] & 0x01;
+        uint16_t tl       = (rxBuffer[llen + 1] << 8) + rxBuffer[llen + 2]; // topic length in bytes
+        uint32_t offset   = llen + 3 + tl + ((qos > 0) ? 2 : 0);            // start of payload
+
+        // The topic and message id must have fit in what was received, before either is read
+        if (offset > len) return true;
+
+        // msgId only present for QOS > 0
+        if (qos > 0) {
+          msgId = (rxBuffer[offset - 2] << 8) + rxBuffer[offset - 1];
+        }
+
+        payload = &rxBuffer[offset];
+
+        // A QoS 2 message is delivered once, then its id is held until the server
+        // releases it so that duplicates are only acknowledged
+        boolean deliver = true;
+
+        if (qos == 2) {
+          if (findInbound(msgId) != nullptr) {
+            deliver = false;
+          }
           else {
-            payload = &buffer[llen + 3 + tl];
-            _callback(topic, payload, len - llen - 3 - tl);
+            uint16_t * inbound = findInbound(0);
+
+            // With nowhere to hold its id the message is left for the server to send again
+            if (inbound == nullptr) return true;
+            *inbound = msgId;
           }
         }
+
+        if (deliver && _topicTable.entries) {
+          _topicTable.dispatch((const char*) &rxBuffer[llen + 3], tl, payload, len - offset, qos, retained);
+        }
+
+        if (deliver && _router) {
+          _router->dispatch((const char*) &rxBuffer[llen + 3], tl, payload, len - offset, qos, retained);
+        }
+
+        if (deliver && _messageCallback) {
+          _messageCallback((const char*) &rxBuffer[llen + 3], tl, payload, len - offset, qos, retained);
+        }
+
+        if (deliver && _callback) {
+          memmove(&rxBuffer[llen + 2], &rxBuffer[llen + 3], tl);          // move topic inside buffer 1 byte to front
+          rxBuffer[llen + 2 + tl] = 0;                                    // end the topic as a 'C' string with \x00
+          _callback((char*) &rxBuffer[llen + 2], payload, len - offset);
+        }
+
+        if (qos > 0) {
+          uint8_t packet[4] = { (uint8_t) ((qos == 1) ? MQTTPUBACK : MQTTPUBREC), 2, (uint8_t) (msgId >> 8), (uint8_t) (msgId & 0xFF) };
+          writeControl(packet, 4);
+        }
       } 
+      else if (((type == MQTTPUBACK)  || (type == MQTTPUBREC) || (type == MQTTPUBCOMP) || 
+                (type == MQTTSUBACK)  || (type == MQTTUNSUBACK)) && (len >= (uint32_t) (llen + 3))) {
+        msgId = (rxBuffer[llen + 1] << 8) + rxBuffer[llen + 2];
+
+        Inflight * inflight = findInflight(msgId);
+
+        if ((inflight != nullptr) && (inflight->ack == type)) {
+          if (type == MQTTPUBREC) {
+            // The message has arrived: the PUBREL releasing it replaces it in the
+            // store, to be sent again like it until PUBCOMP
+            uint8_t * buf = _store + (inflight - _inflight) * txBufferSize;
+
+            buf[0] = MQTTPUBREL | MQTTQOS1;
+            buf[1] = 2;
+            buf[2] = (msgId >> 8);
+            buf[3] = (msgId & 0xFF);
+
+            inflight->ack    = MQTTPUBCOMP;
+            inflight->length = 4;
+            inflight->sent   = t;
+
+            writeControl(buf, 4);
+          }
+          else if ((type == MQTTSUBACK) || (type == MQTTUNSUBACK)) {
+            releaseInflight(inflight);
+            if (_subscribeCallback) _subscribeCallback(msgId, &rxBuffer[llen + 3], len - (llen + 3));
+
+            // With no request left unacknowledged, every filter sent has been settled
+            if (!subscribing()) settleSubscriptions();
+
+            // Carry on with the filters waiting for a free slot
+            if (_resubscribe < _subCount) resubscribe();
+          }
+          else {
+            releaseInflight(inflight);
+            if (_publishCallback) _publishCallback(msgId, true);
+          }
+        }
+      }
+      else if ((type == MQTTPUBREL) && (len >= (uint32_t) (llen + 3))) {
+        msgId = (rxBuffer[llen + 1] << 8) + rxBuffer[llen + 2];
+
+        uint16_t * inbound = findInbound(msgId);
+
+        if (inbound != nullptr) *inbound = 0;
+
+        // Completed even if the id is unknown, as after a PUBCOMP that was lost
+        uint8_t packet[4] = { MQTTPUBCOMP, 2, (uint8_t) (msgId >> 8), (uint8_t) (msgId & 0xFF) };
+        writeControl(packet, 4);
+      }
       else if (type == MQTTPINGREQ) {
-        buffer[0] = MQTTPINGRESP;
-        buffer[1] = 0;
-        _client->write(buffer, 2);
+        uint8_t packet[2] = { MQTTPINGRESP, 0 };
+        writeControl(packet, 2);
       } 
       else if (type == MQTTPINGRESP) {
         pingOutstanding = false;
       }
     } 
     else if (!connected()) {
-      // readPacket has closed the connection
+      // readAvailable has closed the connection
       return false;
     }
+  } 
+  else if ((_rxState != MQTT_RX_HEADER) && ((millis() - lastInActivity) > (MQTT_SOCKET_TIMEOUT * 1000UL))) {
+    // The rest of a partial packet never arrived
+    _state = MQTT_CONNECTION_TIMEOUT;
+    _client->stop();
+    return false;
   }
   return true;
 }
@@ -450,25 +734,131 @@ boolean PubSubClient::publish(const char * topic,
                               const uint8_t * payload, 
                               unsigned int plength, 
                               boolean retained)
+{
+  return publish(TopicHandle(topic, strlen(topic)), payload, plength, 0, retained);
+}
+
+boolean PubSubClient::publish(const char * topic, 
+                              const uint8_t * payload, 
+                              unsigned int plength, 
+                              uint8_t qos, 
+                              boolean retained)
+{
+  return publish(TopicHandle(topic, strlen(topic)), payload, plength, qos, retained);
+}
+
+boolean PubSubClient::publish(const TopicHandle & topic, 
+                              const uint8_t * payload, 
+                              unsigned int plength, 
+                              boolean retained)
+{
+  return publish(topic, payload, plength, 0, retained);
+}
+
+boolean PubSubClient::publish(const TopicHandle & topic, 
+                              const uint8_t * payload, 
+                              unsigned int plength, 
+                              uint8_t qos, 
+                              boolean retained)
 {
   if (!connected()) return false;
-  if (MQTT_MAX_PACKET_SIZE < (MQTT_MAX_HEADER_SIZE + 2 + strlen(topic) + plength)) return false;
+  if (qos > 2) return false;
 
-  // Leave room in the buffer for header and variable length field
-  uint16_t length = MQTT_MAX_HEADER_SIZE;
-  length = writeString(topic, buffer, length);
-  uint16_t i;
+  // A QoS 1 or 2 packet is built in a free slot of the store, where it stays until acknowledged
+  if (qos > 0) {
+    uint32_t remaining = 2 + (uint32_t) topic.length + 2 + plength;
+
+    if ((MQTT_MAX_HEADER_SIZE + remaining) > txBufferSize) return false;
+
+    if (_store == nullptr) {
+      _store = (uint8_t *) malloc((size_t) _window * txBufferSize);
+      if (_store == nullptr) return false;
+      _storeOwned = true;
+    }
+
+    Inflight * inflight = allocateInflight((qos == 1) ? MQTTPUBACK : MQTTPUBREC);
+
+    if (inflight == nullptr) return false;
+
+    uint8_t * buf    = _store + (inflight - _inflight) * txBufferSize;
+    uint16_t  length = MQTT_MAX_HEADER_SIZE;
+    uint16_t  msgId  = inflight->msgId;
+
+    buf[length++] = topic.prefix[0];
+    buf[length++] = topic.prefix[1];
+    memcpy(&buf[length], topic.topic, topic.length);
+    length += topic.length;
+    buf[length++] = (msgId >> 8);
+    buf[length++] = (msgId & 0xFF);
+    memcpy(&buf[length], payload, plength);
+
+    uint8_t hlen = buildHeader(MQTTPUBLISH | (qos << 1) | (retained ? 1 : 0), buf, remaining);
 
-  for (i = 0; i < plength; i++) {
-    buffer[length++] = payload[i];
+    memmove(buf, buf + (MQTT_MAX_HEADER_SIZE - hlen), hlen + remaining);
+
+    inflight->length = hlen + remaining;
+    _lastMsgId       = msgId;
+
+    if (!writeControl(buf, inflight->length)) {
+      releaseInflight(inflight);
+      return false;
+    }
+    return true;
   }
 
+  // Only the header and topic have to fit in the buffer
+  if ((2 + (uint32_t) topic.length + plength) > MQTT_MAX_REMAINING_LENGTH) return false;
+
+  // Make room for the whole packet if it can fit, otherwise for the header and topic
+  size_t size = MQTT_MAX_HEADER_SIZE + 2 + topic.length;
+
+  if (!reserve(((size + plength) <= txBufferSize) ? (size + plength) : size)) return false;
+
+  // Leave room in the buffer for header and variable length field
+  uint8_t * buf    = txBuffer + _txPos;
+  uint16_t  length = MQTT_MAX_HEADER_SIZE;
+
+  buf[length++] = topic.prefix[0];
+  buf[length++] = topic.prefix[1];
+
   uint8_t header = MQTTPUBLISH;
   if (retained) {
     header |= 1;
   }
 
-  return write(header, buffer, length - MQTT_MAX_HEADER_SIZE);
+  // A packet that fits is copied in whole, so it is batched or, without a vectored
+  // client, still sent in a single write
+  if ((_batching || (_vclient == nullptr)) && ((_txPos + size + plength) <= txBufferSize)) {
+    memcpy(&buf[length], topic.topic, topic.length);
+    length += topic.length;
+    memcpy(&buf[length], payload, plength);
+    return write(header, buf, length + plength - MQTT_MAX_HEADER_SIZE);
+  }
+
+  // Otherwise anything already batched, the header, the topic and the payload
+  // are sent together without copying the topic or payload
+  uint8_t   hlen = buildHeader(header, buf, 2 + topic.length + plength);
+  MQTTIOVec iov[4];
+
+  iov[0].base   = txBuffer;
+  iov[0].length = _txPos;
+  iov[1].base   = buf + (MQTT_MAX_HEADER_SIZE - hlen);
+  iov[1].length = hlen + 2;
+  iov[2].base   = (const uint8_t *) topic.topic;
+  iov[2].length = topic.length;
+  iov[3].base   = payload;
+  iov[3].length = plength;
+
+  // Written one buffer at a time, the topic is better off going out with the header
+  if (_vclient == nullptr) {
+    memcpy(&buf[length], topic.topic, topic.length);
+    iov[1].length += topic.length;
+    iov[2].length  = 0;
+  }
+
+  _txPos = 0;
+
+  return writeVector(iov, 4);
 }
 
 boolean PubSubClient::publish_P(const char    * topic, 
@@ -478,78 +868,170 @@ boolean PubSubClient::publish_P(const char    * topic,
 {
   if (!connected()) return false;
 
-  unsigned int rc     = 0;
-  unsigned int pos    = 0;
-  uint16_t     tlen   = strlen(topic);
-  uint8_t      llen   = 0;
-  uint8_t      header = MQTTPUBLISH;
+  size_t tlen = strlen(topic);
 
-  if (retained) header |= 1;
+  if ((2 + tlen + plength) > MQTT_MAX_REMAINING_LENGTH) return false;
+  if (!reserve(MQTT_MAX_HEADER_SIZE + 2 + tlen)) return false;
 
-  buffer[pos++] = header;
+  uint8_t header = MQTTPUBLISH;
 
-  unsigned int len = plength + 2 + tlen;
+  if (retained) header |= 1;
 
-  do {
-    uint8_t digit = len & 0x7F;
-    len >>= 7;
-  
-    if (len > 0) digit |= 0x80;
-  
-    buffer[pos++] = digit;
-    llen++;
-  } while (len > 0);
+  // Build the header and topic behind anything already staged
+  stage(header, txBuffer + _txPos, writeString(topic, txBuffer + _txPos, MQTT_MAX_HEADER_SIZE), plength);
 
-  pos = writeString(topic, buffer, pos);
+  unsigned int i = 0;
 
-  rc += _client->write(buffer, pos);
+  // The buffer doubles as the bounce buffer for the payload: it is filled up from
+  // program memory and sent, as many times as needed
+  while (true) {
+    while ((_txPos < txBufferSize) && (i < plength)) {
+      txBuffer[_txPos++] = pgm_read_byte_near(payload + i++);
+    }
+
+    // While batching, a packet that fits stays in the buffer
+    if ((i >= plength) && _batching) return true;
 
-  for (unsigned int i = 0; i < plength; i++) {
-    rc += _client->write((char) pgm_read_byte_near(payload + i));
+    if (!flushBuffer()) return false;
+    if (i >= plength) return true;
   }
+}
 
-  lastOutActivity = millis();
+boolean PubSubClient::publishFramed(const uint8_t * packet, size_t length) 
+{
+  if (!connected()) return false;
+  if ((length < 2) || ((packet[0] & 0xF6) != MQTTPUBLISH)) return false;
 
-  return rc == (tlen + 4 + plength);
+  if (_batching && (length <= txBufferSize)) return writeControl(packet, length);
+
+  return flushBuffer() && writeBuffer(packet, length);
 }
 
 boolean PubSubClient::beginPublish(const char* topic, unsigned int plength, boolean retained) 
 {
   if (!connected()) return false;
+  if (!reserve(MQTT_MAX_HEADER_SIZE + 2 + strlen(topic))) return false;
 
-  // Send the header and variable length field
-  uint16_t length = writeString(topic, buffer, MQTT_MAX_HEADER_SIZE);
-  uint8_t  header = MQTTPUBLISH;
+  uint8_t header = MQTTPUBLISH;
 
   if (retained) header |= 1;
 
-  size_t hlen = buildHeader(header, buffer, plength + length - MQTT_MAX_HEADER_SIZE);
-  uint16_t rc = _client->write(buffer + (MQTT_MAX_HEADER_SIZE - hlen), length - (MQTT_MAX_HEADER_SIZE - hlen));
-  lastOutActivity = millis();
+  // Stage the header and variable length field; the payload is collected behind them
+  stage(header, txBuffer + _txPos, writeString(topic, txBuffer + _txPos, MQTT_MAX_HEADER_SIZE), plength);
+  _txFailed = false;
 
-  return rc == (length - (MQTT_MAX_HEADER_SIZE - hlen));
+  return true;
 }
 
 boolean PubSubClient::endPublish() 
 {
-  return true;
+  boolean result = (_batching || flushBuffer()) && !_txFailed;
+
+  _txFailed = false;
+
+  return result;
 }
 
 size_t PubSubClient::write(uint8_t data) 
 {
-  lastOutActivity = millis();
-  return _client->write(data);
+  if ((_txPos >= txBufferSize) && !flushBuffer()) {
+    _txFailed = true;
+    return 0;
+  }
+
+  txBuffer[_txPos++] = data;
+
+  return 1;
 }
 
 size_t PubSubClient::write(const uint8_t * buffer, size_t size) 
 {
-  lastOutActivity = millis();
-  return _client->write(buffer, size);
+  if ((_txPos + size) > txBufferSize) {
+    if (!flushBuffer()) {
+      _txFailed = true;
+      return 0;
+    }
+
+    // Too big to be worth staging, so send it as it is
+    if (size >= txBufferSize) {
+      if (writeBuffer(buffer, size)) return size;
+      _txFailed = true;
+      return 0;
+    }
+  }
+
+  memcpy(txBuffer + _txPos, buffer, size);
+  _txPos += size;
+
+  return size;
+}
+
+// Sends whatever has been staged at the start of the transmit buffer
+boolean PubSubClient::flushBuffer() 
+{
+  if (_txPos == 0) return true;
+
+  boolean result = writeBuffer(txBuffer, _txPos);
+
+  _txPos = 0;
+
+  return result;
+}
+
+// Makes room for a packet of up to size bytes behind anything already staged,
+// sending what is staged first if it would not fit
+boolean PubSubClient::reserve(size_t size) 
+{
+  if (size > txBufferSize) return false;
+  if ((_txPos + size) > txBufferSize) return flushBuffer();
+  return true;
+}
+
+// Adds the fixed header to the length bytes built at buf (which starts MQTT_MAX_HEADER_SIZE
+// bytes ahead of them) and stages the lot, closing the gap left for the longest header.
+// extra is the number of bytes that will follow. Returns the new staged length
+uint16_t PubSubClient::stage(uint8_t header, uint8_t * buf, uint16_t length, uint32_t extra) 
+{
+  uint8_t hlen = buildHeader(header, buf, length - MQTT_MAX_HEADER_SIZE + extra);
+
+  length -= MQTT_MAX_HEADER_SIZE - hlen;
+  memmove(buf, buf + (MQTT_MAX_HEADER_SIZE - hlen), length);
+  _txPos += length;
+
+  return _txPos;
+}
+
+// Sends a small packet, or stages it while batching
+boolean PubSubClient::writeControl(const uint8_t * packet, uint16_t length) 
+{
+  if (_batching) {
+    if (!reserve(length)) return false;
+    memcpy(txBuffer + _txPos, packet, length);
+    _txPos += length;
+    return true;
+  }
+  return writeBuffer(packet, length);
+}
+
+void PubSubClient::beginBatch() 
+{
+  _batching = true;
+}
+
+boolean PubSubClient::flushBatch() 
+{
+  _batching = false;
+  return flushBuffer();
 }
 
-size_t PubSubClient::buildHeader(uint8_t header, uint8_t * buf, uint16_t length) 
+boolean PubSubClient::batching() 
 {
-  uint16_t len  = length;
+  return _batching;
+}
+
+size_t PubSubClient::buildHeader(uint8_t header, uint8_t * buf, uint32_t length) 
+{
+  uint32_t len  = length;
   uint8_t  llen = 0;
   uint8_t  pos  = 0;
   uint8_t  lenBuf[4];
@@ -574,33 +1056,169 @@ size_t PubSubClient::buildHeader(uint8_t header, uint8_t * buf, uint16_t length)
 
 boolean PubSubClient::write(uint8_t header, uint8_t * buf, uint16_t length) 
 {
-  uint16_t rc;
-  uint8_t  hlen = buildHeader(header, buf, length);
+  if (_batching) {
+    stage(header, buf, length + MQTT_MAX_HEADER_SIZE, 0);
+    return true;
+  }
+
+  uint8_t hlen = buildHeader(header, buf, length);
+
+  return writeBuffer(buf + (MQTT_MAX_HEADER_SIZE - hlen), length + hlen);
+}
+
+boolean PubSubClient::writeBuffer(const uint8_t * buf, size_t length) 
+{
+  boolean result;
 
   #ifdef MQTT_MAX_TRANSFER_SIZE
 
-    uint8_t * writeBuf = buf + (MQTT_MAX_HEADER_SIZE - hlen);
-    uint16_t  bytesRemaining = length + hlen;  //Match the length type
-    uint8_t   bytesToWrite;
-    boolean   result = true;
+    size_t bytesRemaining = length;
+    size_t bytesToWrite;
+    size_t rc;
+
+    result = true;
 
     while((bytesRemaining > 0) && result) {
       bytesToWrite = (bytesRemaining > MQTT_MAX_TRANSFER_SIZE) ? MQTT_MAX_TRANSFER_SIZE : bytesRemaining;
-      rc = _client->write(writeBuf, bytesToWrite);
+      rc = _client->write(buf, bytesToWrite);
       result = (rc == bytesToWrite);
       bytesRemaining -= rc;
-      writeBuf += rc;
+      buf += rc;
     }
 
-    return result;
-
   #else
 
-    rc = _client->write(buf + (MQTT_MAX_HEADER_SIZE - hlen), length + hlen);
-    lastOutActivity = millis();
-    return rc == (hlen + length);
+    result = (_client->write(buf, length) == length);
 
   #endif
+
+  lastOutActivity = millis();
+  return result;
+}
+
+boolean PubSubClient::writeVector(const MQTTIOVec * iov, uint8_t count) 
+{
+  if (_vclient != nullptr) {
+    size_t total = 0;
+    for (uint8_t i = 0; i < count; i++) {
+      total += iov[i].length;
+    }
+    lastOutActivity = millis();
+    return _vclient->writev(iov, count) == total;
+  }
+
+  for (uint8_t i = 0; i < count; i++) {
+    if ((iov[i].length > 0) && !writeBuffer(iov[i].base, iov[i].length)) return false;
+  }
+  return true;
+}
+
+// Takes a free slot of the in-flight table for a packet expecting the given
+// acknowledgement, giving it the next message id that maps onto that slot
+PubSubClient::Inflight * PubSubClient::allocateInflight(uint8_t ack) 
+{
+  if (_free == 0) return nullptr;
+
+  // Ids map onto slots by id % _window, so the first free slot at or after the
+  // one for the next id in sequence gives the nearest id that can be used
+  uint16_t next  = (nextMsgId == 0xFFFF) ? 1 : nextMsgId + 1;
+  uint8_t  start = next % _window;
+  uint32_t free  = (start == 0) ? _free : (((_free >> start) | (_free << (_window - start))) & (MQTT_INFLIGHT_MASK >> (MQTT_MAX_INFLIGHT - _window)));
+  uint8_t  skip  = __builtin_ctzl(free);
+
+  // Rather than wrap past 0xFFFF, start again from id 1
+  if ((uint32_t) next + skip > 0xFFFF) {
+    nextMsgId = 0;
+    return allocateInflight(ack);
+  }
+
+  nextMsgId = next + skip;
+
+  uint8_t    slot     = nextMsgId % _window;
+  Inflight * inflight = &_inflight[slot];
+
+  _free &= ~(1UL << slot);
+
+  inflight->msgId  = nextMsgId;
+  inflight->ack    = ack;
+  inflight->length = 0;
+  inflight->sent   = millis();
+
+  return inflight;
+}
+
+// Finds the in-flight packet with the given id straight from the slot its id maps onto
+PubSubClient::Inflight * PubSubClient::findInflight(uint16_t msgId) 
+{
+  Inflight * inflight = &_inflight[msgId % _window];
+
+  if ((msgId == 0) || (inflight->msgId != msgId)) return nullptr;
+  return inflight;
+}
+
+void PubSubClient::releaseInflight(Inflight * inflight) 
+{
+  inflight->msgId = 0;
+  _free |= 1UL << (inflight - _inflight);
+}
+
+// Finds the held id of an inbound QoS 2 message, or a free entry for id 0
+uint16_t * PubSubClient::findInbound(uint16_t msgId) 
+{
+  for (uint8_t i = 0; i < MQTT_MAX_INBOUND; i++) {
+    if (_inbound[i] == msgId) return &_inbound[i];
+  }
+  return nullptr;
+}
+
+// Forgets every in-flight packet, reporting each message to the publish callback
+// and each subscribe or unsubscribe request as failed
+void PubSubClient::endInflight(boolean delivered) 
+{
+  for (uint8_t i = 0; i < MQTT_MAX_INFLIGHT; i++) {
+    Inflight * inflight = &_inflight[i];
+    uint16_t   msgId    = inflight->msgId;
+
+    if ((msgId != 0) && (inflight->length == 0)) {
+      lostInflight(inflight);
+    }
+    else if (msgId != 0) {
+      releaseInflight(inflight);
+      if (_publishCallback) _publishCallback(msgId, delivered);
+    }
+  }
+}
+
+// Forgets a subscribe or unsubscribe request whose acknowledgement will never come
+void PubSubClient::lostInflight(Inflight * inflight) 
+{
+  const uint8_t failure = MQTT_SUBSCRIBE_FAILURE;
+  uint16_t      msgId   = inflight->msgId;
+
+  releaseInflight(inflight);
+  if (_subscribeCallback) _subscribeCallback(msgId, &failure, 1);
+}
+
+// Sends in-flight packets again, with PUBLISH flagged as a duplicate: all of them,
+// or only those that have waited for MQTT_RETRY_INTERVAL. Only messages keep a copy of
+// their packet; other requests are dropped when everything is sent again after reconnecting,
+// and requeueSubscriptions() queues their filters to be sent again
+void PubSubClient::retransmit(unsigned long t, boolean all) 
+{
+  for (uint8_t i = 0; i < MQTT_MAX_INFLIGHT; i++) {
+    Inflight * inflight = &_inflight[i];
+
+    if ((inflight->msgId != 0) && (inflight->length == 0)) {
+      if (all) lostInflight(inflight);
+    }
+    else if ((inflight->msgId != 0) && (all || ((t - inflight->sent) >= (MQTT_RETRY_INTERVAL * 1000UL)))) {
+      uint8_t * buf = _store + i * txBufferSize;
+
+      if (inflight->ack != MQTTPUBCOMP) buf[0] |= 0x08;
+      writeControl(buf, inflight->length);
+      inflight->sent = t;
+    }
+  }
 }
 
 boolean PubSubClient::subscribe(const char* topic) 
@@ -610,47 +1228,325 @@ boolean PubSubClient::subscribe(const char* topic)
 
 boolean PubSubClient::subscribe(const char* topic, uint8_t qos) 
 {
-  if (!connected()) return false;
-  if (qos > 1) return false;
-  if (MQTT_MAX_PACKET_SIZE < (9 + strlen(topic))) return false;
+  return subscribe(&topic, &qos, 1);
+}
 
-  // Leave room in the buffer for header and variable length field
-  uint16_t length = MQTT_MAX_HEADER_SIZE;
-  nextMsgId++;
+boolean PubSubClient::subscribe(const char * const * topics, const uint8_t * qos, size_t count) 
+{
+  if (!checkFilters(MQTTSUBSCRIBE, topics, qos, count)) return false;
 
-  if (nextMsgId == 0) nextMsgId = 1;
+  boolean result = true;
 
-  buffer[length++] = (nextMsgId >> 8);
-  buffer[length++] = (nextMsgId & 0xFF);
-  length = writeString((char*)topic, buffer, length);
-  buffer[length++] = qos;
+  for (size_t i = 0; i < count; i++) {
+    uint8_t q = (qos != nullptr) ? qos[i] : 0;
 
-  return write(MQTTSUBSCRIBE | MQTTQOS1, buffer, length - MQTT_MAX_HEADER_SIZE);
+    // A filter there is no room to remember is sent now, or not at all
+    if (!queueSubscription(topics[i], q)) {
+      result = writeFilters(MQTTSUBSCRIBE, &topics[i], &q, 1) && result;
+    }
+  }
+  return resubscribe() && result;
 }
 
 boolean PubSubClient::unsubscribe(const char * topic) 
 {
-  if (!connected()) return false;
-  if (MQTT_MAX_PACKET_SIZE < (9 + strlen(topic))) return false;
+  return unsubscribe(&topic, 1);
+}
 
-  uint16_t length = MQTT_MAX_HEADER_SIZE;
-  nextMsgId++;
+boolean PubSubClient::unsubscribe(const char * const * topics, size_t count) 
+{
+  if (!checkFilters(MQTTUNSUBSCRIBE, topics, nullptr, count)) return false;
+
+  boolean result = true;
+
+  for (size_t i = 0; i < count; i++) {
+    if (!queueSubscription(topics[i], MQTT_SUB_REMOVE)) {
+      result = writeFilters(MQTTUNSUBSCRIBE, &topics[i], nullptr, 1) && result;
+    }
+  }
+  return resubscribe() && result;
+}
+
+int PubSubClient::findSubscription(const char * topic) 
+{
+  for (uint16_t i = 0; i < _subCount; i++) {
+    if (strcmp(_subTopics[i], topic) == 0) return i;
+  }
+  return -1;
+}
+
+// Moves a topic filter, remembering it if it is new, to the back of those waiting to be
+// sent, with qos to subscribe to it or MQTT_SUB_REMOVE to unsubscribe from it.
+// Returns false if there is no memory left to remember it
+boolean PubSubClient::queueSubscription(const char * topic, uint8_t qos) 
+{
+  int index = findSubscription(topic);
+
+  if (index < 0) {
+    if (_subCount == _subSize) {
+      uint16_t size = (_subSize > 0) ? (_subSize * 2) : MQTT_MAX_SUBSCRIPTIONS;
+
+      if (size <= _subSize) return false;
+
+      char ** topics = (char **) realloc(_subTopics, size * sizeof(_subTopics[0]));
+      if (topics == nullptr) return false;
+      _subTopics = topics;
+
+      uint8_t * qoses = (uint8_t *) realloc(_subQos, size * sizeof(_subQos[0]));
+      if (qoses == nullptr) return false;
+      _subQos  = qoses;
+      _subSize = size;
+    }
+
+    char * copy = strdup(topic);
+
+    if (copy == nullptr) return false;
+
+    index = _subCount++;
+    _subTopics[index] = copy;
+  }
+  else {
+    char * copy = _subTopics[index];
+
+    if ((uint16_t) index < _resubscribe) _resubscribe--;
+
+    memmove(&_subTopics[index], &_subTopics[index + 1], (_subCount - index - 1) * sizeof(_subTopics[0]));
+    memmove(&_subQos[index],    &_subQos[index + 1],    (_subCount - index - 1) * sizeof(_subQos[0]));
+
+    index = _subCount - 1;
+    _subTopics[index] = copy;
+  }
+  _subQos[index] = qos;
+  return true;
+}
+
+// Whether a subscribe or unsubscribe request is waiting for acknowledgement
+boolean PubSubClient::subscribing() 
+{
+  for (uint8_t i = 0; i < MQTT_MAX_INFLIGHT; i++) {
+    if ((_inflight[i].msgId != 0) && (_inflight[i].length == 0)) return true;
+  }
+  return false;
+}
+
+// Forgets the filters sent to be unsubscribed from, and marks the others as settled, once
+// every request they were sent in has been acknowledged
+void PubSubClient::settleSubscriptions() 
+{
+  for (uint16_t i = _resubscribe; i > 0; i--) {
+    if (_subQos[i - 1] == (MQTT_SUB_REMOVE | MQTT_SUB_SENT)) {
+      removeSubscriptions(i - 1, 1);
+      _resubscribe--;
+    }
+    else {
+      _subQos[i - 1] &= ~MQTT_SUB_SENT;
+    }
+  }
+}
+
+// Moves the filters of requests lost with the connection back to the front of those waiting
+// to be sent, in the order they were sent, so that resubscribe() sends them again
+void PubSubClient::requeueSubscriptions() 
+{
+  uint16_t end = _resubscribe;
+
+  for (uint16_t i = end; i > 0; i--) {
+    if (_subQos[i - 1] & MQTT_SUB_SENT) {
+      char    * topic = _subTopics[i - 1];
+      uint8_t   qos   = _subQos[i - 1] & ~MQTT_SUB_SENT;
+
+      memmove(&_subTopics[i - 1], &_subTopics[i], (end - i) * sizeof(_subTopics[0]));
+      memmove(&_subQos[i - 1],    &_subQos[i],    (end - i) * sizeof(_subQos[0]));
+
+      end--;
+      _subTopics[end] = topic;
+      _subQos[end]    = qos;
+    }
+  }
+  _resubscribe = end;
+}
+
+// Forgets count remembered topic filters from index on
+void PubSubClient::removeSubscriptions(uint16_t index, uint16_t count) 
+{
+  for (uint16_t i = index; i < (index + count); i++) {
+    free(_subTopics[i]);
+  }
+
+  _subCount -= count;
+  memmove(&_subTopics[index], &_subTopics[index + count], (_subCount - index) * sizeof(_subTopics[0]));
+  memmove(&_subQos[index],    &_subQos[index + count],    (_subCount - index) * sizeof(_subQos[0]));
+}
+
+// Sends the topic filters waiting, in order, in as many packets as there are free in-flight
+// slots for. The rest follow as SUBACKs and UNSUBACKs free them. Filters sent are marked
+// until settleSubscriptions(), which forgets those unsubscribed from.
+// Returns false if a packet could not be written
+boolean PubSubClient::resubscribe() 
+{
+  boolean batching = _batching;
+  boolean result   = true;
+
+  _batching = true;
+
+  while ((_resubscribe < _subCount) && (_free != 0) && connected()) {
+    const char * const * topics = (const char * const *) &_subTopics[_resubscribe];
+    boolean              remove = (_subQos[_resubscribe] == MQTT_SUB_REMOVE);
+    uint8_t              type   = remove ? MQTTUNSUBSCRIBE : MQTTSUBSCRIBE;
+    uint16_t             run    = 1;
+
+    // Only a run of the same kind of request can share a packet
+    while (((_resubscribe + run) < _subCount) && ((_subQos[_resubscribe + run] == MQTT_SUB_REMOVE) == remove)) {
+      run++;
+    }
+
+    size_t n = packFilters(type, topics, run);
+
+    if (!writeFilters(type, topics, remove ? nullptr : &_subQos[_resubscribe], n)) {
+      result = false;
+      break;
+    }
+
+    for (; n > 0; n--) {
+      _subQos[_resubscribe++] |= MQTT_SUB_SENT;
+    }
+  }
+
+  _batching = batching;
+
+  if (!batching) result = flushBuffer() && result;
+
+  return result;
+}
+
+// Size of the fixed header for a packet with the given remaining length
+static uint8_t headerLength(uint32_t length) 
+{
+  uint8_t hlen = 2;
+
+  while (length >= 128) {
+    length >>= 7;
+    hlen++;
+  }
+  return hlen;
+}
+
+// Number of the topic filters, from the first, that go in one SUBSCRIBE or UNSUBSCRIBE
+size_t PubSubClient::packFilters(uint8_t type, const char * const * topics, size_t count) 
+{
+  uint8_t  extra  = (type == MQTTSUBSCRIBE) ? 3 : 2; // length prefix, and qos to subscribe
+  uint32_t length = 2;
+  size_t   n      = 0;
+
+  while (n < count) {
+    uint32_t next = length + strlen(topics[n]) + extra;
+
+    if ((n > 0) && ((headerLength(next) + next) > txBufferSize)) break;
+
+    length = next;
+    n++;
+  }
+  return n;
+}
+
+// Whether the client is connected and every topic filter is valid and fits in a packet on its own
+boolean PubSubClient::checkFilters(uint8_t type, const char * const * topics, const uint8_t * qos, size_t count) 
+{
+  if (!connected() || (count == 0)) return false;
+
+  uint8_t extra = (type == MQTTSUBSCRIBE) ? 3 : 2;
+
+  for (size_t i = 0; i < count; i++) {
+    size_t tlen = strlen(topics[i]);
+
+    if ((qos != nullptr) && (qos[i] > 2)) return false;
+
+    // Each filter has to fit on its own, with room for the largest header
+    if ((9 + tlen) > txBufferSize) return false;
+    if ((headerLength(2 + tlen + extra) + 2 + tlen + extra) > txBufferSize) return false;
+  }
+  return true;
+}
 
-  if (nextMsgId == 0) nextMsgId = 1;
+// Sends SUBSCRIBE or UNSUBSCRIBE packets for the topic filters, packing as many into each
+// as fit in the transmit buffer. Nothing is sent unless every filter is valid and there
+// are enough free in-flight slots for all of the packets
+boolean PubSubClient::writeFilters(uint8_t type, const char * const * topics, const uint8_t * qos, size_t count) 
+{
+  if (!checkFilters(type, topics, qos, count)) return false;
+
+  uint8_t extra   = (type == MQTTSUBSCRIBE) ? 3 : 2;
+  size_t  packets = 0;
+
+  for (size_t i = 0; i < count; packets++) {
+    i += packFilters(type, &topics[i], count - i);
+  }
+
+  if (packets > (size_t) __builtin_popcountl(_free)) return false;
+
+  // The packets are staged back to back and sent together
+  boolean batching = _batching;
+  boolean result   = true;
+  size_t  i        = 0;
+
+  _batching = true;
+
+  while (result && (i < count)) {
+    size_t   n      = packFilters(type, &topics[i], count - i);
+    uint32_t length = 2;
+
+    for (size_t j = 0; j < n; j++) {
+      length += strlen(topics[i + j]) + extra;
+    }
+
+    uint8_t hlen = headerLength(length);
+
+    if (!reserve(hlen + length)) {
+      result = false;
+      break;
+    }
+
+    Inflight * inflight = allocateInflight((type == MQTTSUBSCRIBE) ? MQTTSUBACK : MQTTUNSUBACK);
+    uint8_t  * buf      = txBuffer + _txPos;
+    uint8_t    header[MQTT_MAX_HEADER_SIZE];
+    uint16_t   pos      = hlen;
+    uint16_t   msgId    = inflight->msgId;
+
+    buildHeader(type | MQTTQOS1, header, length);
+    memcpy(buf, header + (MQTT_MAX_HEADER_SIZE - hlen), hlen);
+
+    buf[pos++] = (msgId >> 8);
+    buf[pos++] = (msgId & 0xFF);
 
-  buffer[length++] = (nextMsgId >> 8);
-  buffer[length++] = (nextMsgId & 0xFF);
+    for (; n > 0; n--, i++) {
+      pos = writeString(topics[i], buf, pos);
+      if (type == MQTTSUBSCRIBE) buf[pos++] = (qos != nullptr) ? qos[i] : 0;
+    }
+
+    _txPos    += pos;
+    _lastMsgId = msgId;
+  }
+
+  _batching = batching;
 
-  length = writeString(topic, buffer, length);
+  if (!batching) result = flushBuffer() && result;
 
-  return write(MQTTUNSUBSCRIBE | MQTTQOS1, buffer, length - MQTT_MAX_HEADER_SIZE);
+  return result;
 }
 
 void PubSubClient::disconnect() 
 {
-  buffer[0] = MQTTDISCONNECT;
-  buffer[1] = 0;
-  _client->write(buffer, 2);
+  uint8_t packet[2] = { MQTTDISCONNECT, 0 };
+
+  if (_state == MQTT_CONNECTING) {
+    // The CONNECT never went out
+    _txPos    = 0;
+    _batching = false;
+  }
+  else {
+    flushBatch();
+    _client->write(packet, 2);
+  }
   _state = MQTT_DISCONNECTED;
   _client->flush();
   _client->stop();
@@ -676,11 +1572,11 @@ uint16_t PubSubClient::writeString(const char * string, uint8_t * buf, uint16_t
 
 boolean PubSubClient::check_and_write(uint16_t * length, const char * string) 
 {
-  if ((*length + 2 + strlen(string)) > MQTT_MAX_PACKET_SIZE) {
+  if ((*length + 2 + strlen(string)) > txBufferSize) {
     _client->stop();
     return false;
   }
-  *length = writeString(string, buffer, *length);
+  *length = writeString(string, txBuffer, *length);
   return true;
 }
 
@@ -690,6 +1586,9 @@ boolean PubSubClient::connected()
   if (_client == nullptr ) {
     rc = false;
   } 
+  else if (connecting()) {
+    rc = false;
+  }
   else {
     rc = _client->connected();
     if (!rc) {
@@ -734,16 +1633,66 @@ PubSubClient & PubSubClient::setCallback(MQTT_CALLBACK_SIGNATURE(callback))
   return *this;
 }
 
-PubSubClient & PubSubClient::setClient(Client & client)
+PubSubClient & PubSubClient::setMessageCallback(MQTT_MESSAGE_CALLBACK_SIGNATURE(callback)) 
 {
-  _client = &client;
+  _messageCallback = callback;
 
   return *this;
 }
 
-PubSubClient & PubSubClient::setStream(Stream & stream)
+PubSubClient & PubSubClient::setRouter(TopicRouter & router) 
 {
-  _stream = &stream;
+  _router = &router;
+  return *this;
+}
+
+PubSubClient & PubSubClient::setTopicTable(const TopicTableRef & table) 
+{
+  _topicTable = table;
+  return *this;
+}
+
+PubSubClient & PubSubClient::setTopicTable_P(const TopicTableRef & table) 
+{
+  _topicTable = table;
+  _topicTable.progmem = true;
+  return *this;
+}
+
+PubSubClient & PubSubClient::setClient(Client & client)
+{
+  _client  = &client;
+  _vclient = nullptr;
+
+  return *this;
+}
+
+PubSubClient & PubSubClient::setClient(Client & client, VectoredClient & vectored)
+{
+  _client  = &client;
+  _vclient = &vectored;
+
+  return *this;
+}
+
+PubSubClient & PubSubClient::setWaitStrategy(uint8_t strategy)
+{
+  _waitStrategy = strategy;
+
+  return *this;
+}
+
+PubSubClient & PubSubClient::setWaitStrategy(WaitableClient & waitable)
+{
+  _wclient      = &waitable;
+  _waitStrategy = MQTT_WAIT_BLOCK;
+
+  return *this;
+}
+
+PubSubClient & PubSubClient::setStream(Stream & stream)
+{
+  _stream = &stream;
 
   return *this;
 }
@@ -751,7 +1700,585 @@ void PubSubClient::removeStream() {
   _stream = nullptr;
 }
 
+boolean PubSubClient::setBufferSize(uint16_t size) 
+{
+  return setBufferSize(size, size);
+}
+
+boolean PubSubClient::setBufferSize(uint16_t rxSize, uint16_t txSize) 
+{
+  // Room for at least a fixed header and a topic length
+  if ((rxSize < (MQTT_MAX_HEADER_SIZE + 2)) || (txSize < (MQTT_MAX_HEADER_SIZE + 2))) return false;
+
+  // Not while a partially received packet is held in the buffer, while messages waiting
+  // for acknowledgement are kept in buffer-sized slots, or while packets are staged to send:
+  // a batch, a streamed publish or the CONNECT of an attempt under way
+  if ((_rxState != MQTT_RX_HEADER) || (getInflightCount() > 0)) return false;
+  if ((_txPos != 0) || connecting()) return false;
+
+  // A store of the caller's was sized for the transmit buffer, so that has to stay the same size
+  if ((_store != nullptr) && !_storeOwned && (txSize != txBufferSize)) return false;
+
+  // Both buffers come from one allocation, so a failure leaves the old ones in place
+  uint8_t * block = (uint8_t *) malloc((size_t) rxSize + txSize);
+  if (block == nullptr) return false;
+
+  if (bufferOwned) free(rxBuffer);
+
+  // A store of the client's own is allocated again, to the new size, when it is next needed
+  if (_storeOwned) {
+    free(_store);
+    _store      = nullptr;
+    _storeOwned = false;
+  }
+
+  rxBuffer     = block;
+  txBuffer     = block + rxSize;
+  rxBufferSize = rxSize;
+  txBufferSize = txSize;
+  bufferOwned  = true;
+
+  return true;
+}
+
+boolean PubSubClient::setBuffer(uint8_t * rxBuffer, uint8_t * txBuffer, uint16_t size) 
+{
+  return setBuffer(rxBuffer, size, txBuffer, size);
+}
+
+boolean PubSubClient::setBuffer(uint8_t * rxBuffer, uint16_t rxSize, uint8_t * txBuffer, uint16_t txSize) 
+{
+  if ((rxSize < (MQTT_MAX_HEADER_SIZE + 2)) || (txSize < (MQTT_MAX_HEADER_SIZE + 2))) return false;
+  if ((_rxState != MQTT_RX_HEADER) || (getInflightCount() > 0)) return false;
+  if ((_txPos != 0) || connecting()) return false;
+  if ((_store != nullptr) && !_storeOwned && (txSize != txBufferSize)) return false;
+
+  if (bufferOwned) free(this->rxBuffer);
+
+  if (_storeOwned) {
+    free(_store);
+    _store      = nullptr;
+    _storeOwned = false;
+  }
+
+  this->rxBuffer = rxBuffer;
+  this->txBuffer = txBuffer;
+  rxBufferSize   = rxSize;
+  txBufferSize   = txSize;
+  bufferOwned    = false;
+
+  return true;
+}
+
+uint16_t PubSubClient::getBufferSize() 
+{
+  return (rxBufferSize < txBufferSize) ? rxBufferSize : txBufferSize;
+}
+
+uint16_t PubSubClient::getRxBufferSize() 
+{
+  return rxBufferSize;
+}
+
+uint16_t PubSubClient::getTxBufferSize() 
+{
+  return txBufferSize;
+}
+
+uint16_t PubSubClient::getLastMessageId() 
+{
+  return _lastMsgId;
+}
+
+PubSubClient & PubSubClient::setPublishCallback(MQTT_PUBLISH_CALLBACK_SIGNATURE(callback)) 
+{
+  _publishCallback = callback;
+  return *this;
+}
+
+PubSubClient & PubSubClient::setSubscribeCallback(MQTT_SUBSCRIBE_CALLBACK_SIGNATURE(callback)) 
+{
+  _subscribeCallback = callback;
+  return *this;
+}
+
+boolean PubSubClient::setInflightWindow(uint8_t window) 
+{
+  // The store is allocated again, to the new size, when it is next needed
+  return setInflightWindow(window, nullptr);
+}
+
+boolean PubSubClient::setInflightWindow(uint8_t window, uint8_t * store) 
+{
+  if ((window == 0) || (window > MQTT_MAX_INFLIGHT) || (getInflightCount() > 0)) return false;
+
+  if (_storeOwned) free(_store);
+
+  _store      = store;
+  _storeOwned = false;
+  _window     = window;
+  _free       = MQTT_INFLIGHT_MASK >> (MQTT_MAX_INFLIGHT - window);
+
+  return true;
+}
+
+uint8_t PubSubClient::getInflightCount() 
+{
+  return _window - __builtin_popcountl(_free);
+}
+
+unsigned long PubSubClient::nextKeepalive() 
+{
+  unsigned long t = millis();
+
+  // Measured, as in loop(), from the older of the last activity in each direction
+  unsigned long last = ((t - lastInActivity) > (t - lastOutActivity)) ? lastInActivity : lastOutActivity;
+
+  return last + (MQTT_KEEPALIVE * 1000UL) + 1;
+}
+
+// Milliseconds from t until due, or 0 once it has passed
+static unsigned long remaining(unsigned long due, unsigned long t) 
+{
+  return ((long) (due - t) > 0) ? (due - t) : 0;
+}
+
+unsigned long PubSubClient::nextDeadline() 
+{
+  unsigned long t = millis();
+
+  if (connecting()) {
+    return remaining(lastInActivity + (MQTT_SOCKET_TIMEOUT * 1000UL) + 1, t);
+  }
+
+  if (_state != MQTT_CONNECTED) {
+    if (!_autoReconnect || (_connectId == nullptr) || (_state == MQTT_DISCONNECTED)) return MQTT_NO_DEADLINE;
+
+    // The first call to loop() only schedules the attempt
+    if (!_reconnectPending) return 0;
+    return remaining(_reconnectStart + _reconnectWait, t);
+  }
+
+  // A lost connection is noticed, and data the client already holds is read, by loop()
+  if (!_client->connected() || _client->available()) return 0;
+
+  unsigned long wait = remaining(nextKeepalive(), t);
+
+  if (_rxState != MQTT_RX_HEADER) {
+    unsigned long partial = remaining(lastInActivity + (MQTT_SOCKET_TIMEOUT * 1000UL) + 1, t);
+    if (partial < wait) wait = partial;
+  }
+
+  for (uint8_t i = 0; i < MQTT_MAX_INFLIGHT; i++) {
+    Inflight * inflight = &_inflight[i];
+
+    if ((inflight->msgId != 0) && (inflight->length != 0)) {
+      unsigned long retry = remaining(inflight->sent + (MQTT_RETRY_INTERVAL * 1000UL), t);
+      if (retry < wait) wait = retry;
+    }
+  }
+
+  return wait;
+}
+
+boolean PubSubClient::connecting() 
+{
+  return (_state == MQTT_CONNECTING) || (_state == MQTT_CONNECT_SENT);
+}
+
+PubSubClient & PubSubClient::setConnectCallback(MQTT_CONNECT_CALLBACK_SIGNATURE(callback)) 
+{
+  _connectCallback = callback;
+  return *this;
+}
+
+PubSubClient & PubSubClient::setAutoReconnect(boolean enabled, unsigned long minDelay, unsigned long maxDelay) 
+{
+  _autoReconnect     = enabled;
+  _reconnectPending  = false;
+  _reconnectMin      = minDelay;
+  _reconnectMax      = (maxDelay > minDelay) ? maxDelay : minDelay;
+  _reconnectBackoff  = minDelay;
+  _reconnectAttempts = 0;
+
+  return *this;
+}
+
+PubSubClient & PubSubClient::setReconnectCallback(MQTT_RECONNECT_CALLBACK_SIGNATURE(callback)) 
+{
+  _reconnectCallback = callback;
+  return *this;
+}
+
+// Schedules the next reconnection attempt while disconnected, and starts it once it is due.
+// Nothing is attempted before the first connect() or after disconnect()
+void PubSubClient::reconnect() 
+{
+  if ((_connectId == nullptr) || (_state == MQTT_DISCONNECTED)) return;
+
+  unsigned long t = millis();
+
+  if (!_reconnectPending) {
+    unsigned long range = (_reconnectBackoff - (_reconnectBackoff / 2)) + 1;
+
+    // random() gives the same numbers on every board that has not called randomSeed(), so
+    // the client id and the microsecond the loss was noticed at set each client apart
+    uint32_t spread = micros();
+
+    for (const char * c = _connectId; *c; c++) {
+      spread = TopicHash::next(spread, *c);
+    }
+
+    _reconnectPending = true;
+    _reconnectStart   = t;
+    _reconnectWait    = (_reconnectBackoff / 2) + (((unsigned long) random(range) + spread) % range);
+    return;
+  }
+
+  if ((t - _reconnectStart) < _reconnectWait) return;
+
+  if (_reconnectAttempts < 0xFFFF) _reconnectAttempts++;
+  _reconnectBackoff = (_reconnectBackoff > (_reconnectMax / 2)) ? _reconnectMax : (_reconnectBackoff * 2);
+
+  if (_reconnectCallback) _reconnectCallback(_reconnectAttempts);
+
+  beginConnect(_connectId, _connectUser, _connectPass, _willTopic, _willQos, _willRetain, _willMessage, _cleanSession);
+}
+
 int PubSubClient::state() 
 {
   return _state;
 }
+
+TopicRouter::TopicRouter(TopicRouterNode * nodes, uint16_t capacity, uint16_t * buckets, uint16_t bucketCount) :
+_nodes(nodes),
+_capacity(capacity),
+_used(0),
+_free(MQTT_ROUTER_NONE),
+_buckets(buckets),
+_mask(bucketCount - 1),
+_single(MQTT_ROUTER_NONE),
+_multi(MQTT_ROUTER_NONE)
+{
+  for (uint16_t i = 0; i < bucketCount; i++) {
+    _buckets[i] = MQTT_ROUTER_NONE;
+  }
+}
+
+// Takes a node from those freed, or else one never used, as the pool itself may not have been initialised yet
+uint16_t TopicRouter::allocate(const char * level, uint16_t length, uint16_t parent) 
+{
+  uint16_t index;
+
+  if (_free != MQTT_ROUTER_NONE) {
+    index = _free;
+    _free = _nodes[index].next;
+  }
+  else if (_used < _capacity) {
+    index = _used++;
+  }
+  else {
+    return MQTT_ROUTER_NONE;
+  }
+
+  TopicRouterNode * node = &_nodes[index];
+
+  node->level    = level;
+  node->length   = length;
+  node->parent   = parent;
+  node->next     = MQTT_ROUTER_NONE;
+  node->single   = MQTT_ROUTER_NONE;
+  node->multi    = MQTT_ROUTER_NONE;
+  node->children = 0;
+  node->handler  = nullptr;
+
+  return index;
+}
+
+// The link to the + or # level below parent, or at the top
+uint16_t * TopicRouter::wildcard(uint16_t parent, char kind) 
+{
+  if (parent == MQTT_ROUTER_NONE) return (kind == '+') ? &_single : &_multi;
+
+  return (kind == '+') ? &_nodes[parent].single : &_nodes[parent].multi;
+}
+
+// The bucket a literal level below parent is chained from
+uint16_t * TopicRouter::bucket(uint16_t parent, const char * level, uint16_t length) 
+{
+  return &_buckets[TopicHash::mix(TopicHash::of(level, length), parent) & _mask];
+}
+
+uint16_t TopicRouter::find(uint16_t parent, const char * level, uint16_t length) 
+{
+  uint16_t index = *bucket(parent, level, length);
+
+  while ((index != MQTT_ROUTER_NONE) && 
+         ((_nodes[index].parent != parent) || (_nodes[index].length != length) || 
+          (memcmp(_nodes[index].level, level, length) != 0))) {
+    index = _nodes[index].next;
+  }
+
+  return index;
+}
+
+// Frees the node, and then each above it, while it has neither a handler nor anything below it
+void TopicRouter::prune(uint16_t index) 
+{
+  while ((index != MQTT_ROUTER_NONE) && 
+         (_nodes[index].handler == nullptr) && (_nodes[index].children == 0)) {
+    TopicRouterNode * node   = &_nodes[index];
+    uint16_t          parent = node->parent;
+
+    if ((node->length == 1) && ((node->level[0] == '+') || (node->level[0] == '#'))) {
+      *wildcard(parent, node->level[0]) = MQTT_ROUTER_NONE;
+    }
+    else {
+      uint16_t * link = bucket(parent, node->level, node->length);
+
+      while (*link != index) link = &_nodes[*link].next;
+      *link = node->next;
+    }
+
+    node->next = _free;
+    _free      = index;
+
+    if (parent != MQTT_ROUTER_NONE) _nodes[parent].children--;
+    index = parent;
+  }
+}
+
+boolean TopicRouter::add(const char * filter, MQTT_MESSAGE_CALLBACK_SIGNATURE(handler)) 
+{
+  if ((handler == nullptr) || (*filter == 0)) return false;
+
+  // + and # stand for a whole level, and # only for the last one
+  for (const char * c = filter; *c; c++) {
+    if ((*c == '+') || (*c == '#')) {
+      if ((c > filter) && (c[-1] != '/')) return false;
+      if ((c[1] != 0) && (c[1] != '/')) return false;
+      if ((*c == '#') && (c[1] != 0)) return false;
+    }
+  }
+
+  const char * level  = filter;
+  uint16_t     parent = MQTT_ROUTER_NONE;
+  uint16_t     index;
+
+  while (true) {
+    const char * end    = strchr(level, '/');
+    uint16_t     length;
+    boolean      wild;
+
+    if (end == nullptr) end = level + strlen(level);
+    length = end - level;
+    wild   = (length == 1) && ((*level == '+') || (*level == '#'));
+
+    index = wild ? *wildcard(parent, *level) : find(parent, level, length);
+
+    if (index == MQTT_ROUTER_NONE) {
+      index = allocate(level, length, parent);
+
+      // Give back whatever was added for the filter so far
+      if (index == MQTT_ROUTER_NONE) {
+        prune(parent);
+        return false;
+      }
+
+      if (wild) {
+        *wildcard(parent, *level) = index;
+      }
+      else {
+        uint16_t * link = bucket(parent, level, length);
+
+        _nodes[index].next = *link;
+        *link = index;
+      }
+
+      if (parent != MQTT_ROUTER_NONE) _nodes[parent].children++;
+    }
+
+    if (*end == 0) break;
+
+    level  = end + 1;
+    parent = index;
+  }
+
+  _nodes[index].handler = handler;
+
+  return true;
+}
+
+boolean TopicRouter::remove(const char * filter) 
+{
+  const char * level = filter;
+  uint16_t     index = MQTT_ROUTER_NONE;
+
+  while (true) {
+    const char * end    = strchr(level, '/');
+    uint16_t     length;
+
+    if (end == nullptr) end = level + strlen(level);
+    length = end - level;
+
+    if ((length == 1) && ((*level == '+') || (*level == '#'))) {
+      index = *wildcard(index, *level);
+    }
+    else {
+      index = find(index, level, length);
+    }
+
+    if (index == MQTT_ROUTER_NONE) return false;
+    if (*end == 0) break;
+
+    level = end + 1;
+  }
+
+  boolean found = (_nodes[index].handler != nullptr);
+
+  _nodes[index].handler = nullptr;
+  prune(index);
+
+  return found;
+}
+
+uint16_t TopicRouter::dispatch(const char    * topic, 
+                               uint16_t        topicLength, 
+                               const uint8_t * payload, 
+                               unsigned int    length, 
+                               uint8_t         qos, 
+                               boolean         retained) 
+{
+  return match(MQTT_ROUTER_NONE, topic, topic, topic + topicLength, payload, length, qos, retained);
+}
+
+// Calls the handlers of filters, from the levels below parent down, that match the
+// topic from level to end. Returns the number called
+uint16_t TopicRouter::match(uint16_t        parent, 
+                            const char    * topic, 
+                            const char    * level, 
+                            const char    * end, 
+                            const uint8_t * payload, 
+                            unsigned int    length, 
+                            uint8_t         qos, 
+                            boolean         retained) 
+{
+  const char * next   = (const char *) memchr(level, '/', end - level);
+  uint16_t     llen   = ((next != nullptr) ? next : end) - level;
+  uint16_t     count  = 0;
+  uint16_t     index;
+
+  // Wildcards do not match a first level starting with $, as in $SYS
+  if (!((level == topic) && (llen > 0) && (*level == '$'))) {
+    index = *wildcard(parent, '#');
+
+    if ((index != MQTT_ROUTER_NONE) && _nodes[index].handler) {
+      _nodes[index].handler(topic, end - topic, payload, length, qos, retained);
+      count++;
+    }
+
+    index = *wildcard(parent, '+');
+
+    if (index != MQTT_ROUTER_NONE) {
+      count += matched(index, topic, next, end, payload, length, qos, retained);
+    }
+  }
+
+  index = find(parent, level, llen);
+
+  if (index != MQTT_ROUTER_NONE) {
+    count += matched(index, topic, next, end, payload, length, qos, retained);
+  }
+
+  return count;
+}
+
+// Calls the handlers of filters through the node, which matched the level ending at next,
+// or at end when next is null. Returns the number called
+uint16_t TopicRouter::matched(uint16_t        index, 
+                              const char    * topic, 
+                              const char    * next, 
+                              const char    * end, 
+                              const uint8_t * payload, 
+                              unsigned int    length, 
+                              uint8_t         qos, 
+                              boolean         retained) 
+{
+  if (next != nullptr) return match(index, topic, next + 1, end, payload, length, qos, retained);
+
+  TopicRouterNode * node  = &_nodes[index];
+  uint16_t          count = 0;
+
+  if (node->handler) {
+    node->handler(topic, end - topic, payload, length, qos, retained);
+    count++;
+  }
+
+  // A # below also matches its parent level
+  if ((node->multi != MQTT_ROUTER_NONE) && _nodes[node->multi].handler) {
+    _nodes[node->multi].handler(topic, end - topic, payload, length, qos, retained);
+    count++;
+  }
+
+  return count;
+}
+
+const TopicEntry * TopicTableRef::find(const char * topic, uint16_t length) const 
+{
+  uint32_t hash = TopicHash::start();
+
+  for (uint16_t i = 0; i < length; i++) {
+    hash = TopicHash::next(hash, topic[i]);
+  }
+
+  if (progmem) {
+    uint32_t     s;
+    uint16_t     elen;
+    const char * etopic;
+
+    memcpy_P(&s, seed, sizeof(s));
+
+    uint8_t slot = pgm_read_byte_near(&slots[TopicHash::mix(hash, s) & mask]);
+
+    if (slot == 0) return nullptr;
+
+    const TopicEntry * entry = &entries[slot - 1];
+
+    memcpy_P(&elen,   &entry->length, sizeof(elen));
+    memcpy_P(&etopic, &entry->topic,  sizeof(etopic));
+
+    if ((elen != length) || (memcmp_P(topic, etopic, length) != 0)) return nullptr;
+
+    return entry;
+  }
+
+  uint8_t slot = slots[TopicHash::mix(hash, *seed) & mask];
+
+  if (slot == 0) return nullptr;
+
+  const TopicEntry * entry = &entries[slot - 1];
+
+  if ((entry->length != length) || (memcmp(entry->topic, topic, length) != 0)) return nullptr;
+
+  return entry;
+}
+
+boolean TopicTableRef::dispatch(const char    * topic, 
+                                uint16_t        topicLength, 
+                                const uint8_t * payload, 
+                                unsigned int    length, 
+                                uint8_t         qos, 
+                                boolean         retained) const 
+{
+  const TopicEntry * entry = find(topic, topicLength);
+
+  if (entry == nullptr) return false;
+
+  MQTT_TOPIC_HANDLER_SIGNATURE(handler);
+
+  if (progmem) memcpy_P(&handler, &entry->handler, sizeof(handler));
+  else handler = entry->handler;
+
+  handler(topic, topicLength, payload, length, qos, retained);
+  return true;
+}
@@ -21,7 +21,8 @@
   #define MQTT_VERSION MQTT_VERSION_3_1_1
 #endif
 
-// MQTT_MAX_PACKET_SIZE : Maximum packet size
+// MQTT_MAX_PACKET_SIZE : Default maximum packet size. Can be changed at runtime with
+//  setBufferSize() or by handing the client buffers of your own with setBuffer().
 #ifndef MQTT_MAX_PACKET_SIZE
   #define MQTT_MAX_PACKET_SIZE 128
 #endif
@@ -36,12 +37,63 @@
   #define MQTT_SOCKET_TIMEOUT 15
 #endif
 
+// MQTT_MAX_INFLIGHT : Maximum number of packets waiting to be acknowledged at once: QoS 1 and 2
+//  messages, which each keep a copy of their packet until then, and subscribe and unsubscribe
+//  requests. At most 32.
+#ifndef MQTT_MAX_INFLIGHT
+  #define MQTT_MAX_INFLIGHT 4
+#endif
+
+#if (MQTT_MAX_INFLIGHT < 1) || (MQTT_MAX_INFLIGHT > 32)
+  #error "MQTT_MAX_INFLIGHT must be between 1 and 32"
+#endif
+
+#define MQTT_INFLIGHT_MASK (0xFFFFFFFFUL >> (32 - MQTT_MAX_INFLIGHT))
+
+// MQTT_MAX_INBOUND : Maximum number of received QoS 2 messages waiting to be released by the server.
+//  Further ones are not acknowledged until there is room, so the server sends them again.
+#ifndef MQTT_MAX_INBOUND
+  #define MQTT_MAX_INBOUND 4
+#endif
+
+// MQTT_MAX_SUBSCRIPTIONS : Number of topic filters there is first room to remember, to be subscribed
+//  to again after connecting to a server that has not kept the session. The room grows as needed.
+#ifndef MQTT_MAX_SUBSCRIPTIONS
+  #define MQTT_MAX_SUBSCRIPTIONS 16
+#endif
+
+// MQTT_RETRY_INTERVAL : Seconds to wait for a message to be acknowledged before it is sent again
+#ifndef MQTT_RETRY_INTERVAL
+  #define MQTT_RETRY_INTERVAL 10
+#endif
+
+// MQTT_RECONNECT_MIN_DELAY : Milliseconds the first automatic reconnection attempt waits for, at most,
+//  after losing the connection. Each failed attempt doubles it, up to MQTT_RECONNECT_MAX_DELAY.
+#ifndef MQTT_RECONNECT_MIN_DELAY
+  #define MQTT_RECONNECT_MIN_DELAY 1000UL
+#endif
+
+#ifndef MQTT_RECONNECT_MAX_DELAY
+  #define MQTT_RECONNECT_MAX_DELAY 60000UL
+#endif
+
+// MQTT_WAIT_SPINS : Times a blocking call such as connect() polls the network client without
+//  pausing before it starts to yield() between polls, with the MQTT_WAIT_YIELD strategy
+#ifndef MQTT_WAIT_SPINS
+  #define MQTT_WAIT_SPINS 64
+#endif
+
+// MQTT_NO_DEADLINE : Returned by nextDeadline() when loop() has nothing to do until data arrives
+#define MQTT_NO_DEADLINE 0xFFFFFFFFUL
+
 // MQTT_MAX_TRANSFER_SIZE : limit how much data is passed to the network client
 //  in each write call. Needed for the Arduino Wifi Shield. Leave undefined to
 //  pass the entire MQTT packet in each write call.
 //#define MQTT_MAX_TRANSFER_SIZE 80
 
 // Possible values for client.state()
+#define MQTT_CONNECT_SENT           -6 // CONNECT sent, waiting for the CONNACK
+#define MQTT_CONNECTING             -5 // Waiting for the network connection to open
 #define MQTT_CONNECTION_TIMEOUT     -4
 #define MQTT_CONNECTION_LOST        -3
 #define MQTT_CONNECT_FAILED         -2
@@ -73,9 +125,17 @@
 #define MQTTQOS1        (1 << 1)
 #define MQTTQOS2        (2 << 1)
 
+// Ways to wait for the network in a blocking call, for setWaitStrategy()
+#define MQTT_WAIT_SPIN   0 // Poll the network client continuously, for the lowest latency
+#define MQTT_WAIT_YIELD  1 // Poll MQTT_WAIT_SPINS times, then yield() between polls
+#define MQTT_WAIT_BLOCK  2 // Block in the client's WaitableClient::wait() until it is ready
+
 // Maximum size of fixed header and variable length size header
 #define MQTT_MAX_HEADER_SIZE 5
 
+// Largest value the 4-byte remaining length field can hold
+#define MQTT_MAX_REMAINING_LENGTH 268435455UL
+
 #if defined(ESP8266) || defined(ESP32)
   #include <functional>
   #define MQTT_CALLBACK_SIGNATURE(c) std::function<void(char *, uint8_t *, unsigned int)> c
@@ -83,39 +143,532 @@
   #define MQTT_CALLBACK_SIGNATURE(c) void (*c)(char *, uint8_t *, unsigned int)
 #endif
 
+// MQTT_MESSAGE_CALLBACK_SIGNATURE : receives a message straight out of the receive buffer.
+//  The topic is passed as pointer and length and is not null-terminated. The arguments are
+//  topic, topic length, payload, payload length, qos and the retained flag.
+#if defined(ESP8266) || defined(ESP32)
+  #define MQTT_MESSAGE_CALLBACK_SIGNATURE(c) std::function<void(const char *, uint16_t, const uint8_t *, unsigned int, uint8_t, boolean)> c
+#else
+  #define MQTT_MESSAGE_CALLBACK_SIGNATURE(c) void (*c)(const char *, uint16_t, const uint8_t *, unsigned int, uint8_t, boolean)
+#endif
+
+// One buffer of a scatter-gather write
+struct MQTTIOVec {
+  const uint8_t * base;
+  size_t          length;
+};
+
+// The Arduino Client API has no calls like those of the two interfaces below. A network
+// client that can make them implements them alongside Client, and is registered for each.
+
+// Sends several buffers in one call, for example with writev(), so that publish() hands
+// the payload to the transport without copying it into the buffer. Registered with
+// setClient(client, vectored). Returns the number of bytes written.
+class VectoredClient {
+public:
+  virtual size_t writev(const MQTTIOVec * iov, uint8_t count) = 0;
+};
+
+// Blocks until the connection is ready, for example with poll(), so that waiting for a
+// packet does not spin. Registered with setWaitStrategy(waitable). Waits up to timeout
+// milliseconds for data to read or, if writable, for the connection to take more data.
+// Returns true if it became ready, or has failed, before the timeout.
+class WaitableClient {
+public:
+  virtual boolean wait(boolean writable, unsigned long timeout) = 0;
+};
+
+// MQTT_PUBLISH_CALLBACK_SIGNATURE : reports the outcome of a QoS 1 or 2 publish. The arguments are
+//  the message id and whether it was delivered, which is false if the session it was sent in was lost.
+#if defined(ESP8266) || defined(ESP32)
+  #define MQTT_PUBLISH_CALLBACK_SIGNATURE(c) std::function<void(uint16_t, boolean)> c
+#else
+  #define MQTT_PUBLISH_CALLBACK_SIGNATURE(c) void (*c)(uint16_t, boolean)
+#endif
+
+// MQTT_SUBSCRIBE_CALLBACK_SIGNATURE : reports the outcome of a subscribe or unsubscribe request.
+//  The arguments are the message id and the return codes from the SUBACK, one per topic filter:
+//  the QoS granted, or MQTT_SUBSCRIBE_FAILURE. An UNSUBACK has no return codes. A request lost
+//  with the connection is reported with a single MQTT_SUBSCRIBE_FAILURE, and its filters are
+//  sent again in a new request.
+#if defined(ESP8266) || defined(ESP32)
+  #define MQTT_SUBSCRIBE_CALLBACK_SIGNATURE(c) std::function<void(uint16_t, const uint8_t *, uint16_t)> c
+#else
+  #define MQTT_SUBSCRIBE_CALLBACK_SIGNATURE(c) void (*c)(uint16_t, const uint8_t *, uint16_t)
+#endif
+
+// SUBACK return code for a topic filter the server refused
+#define MQTT_SUBSCRIBE_FAILURE 0x80
+
+// MQTT_CONNECT_CALLBACK_SIGNATURE : reports the end of a connection attempt with the state it
+//  left the client in: MQTT_CONNECTED, or the reason it failed.
+#if defined(ESP8266) || defined(ESP32)
+  #define MQTT_CONNECT_CALLBACK_SIGNATURE(c) std::function<void(int)> c
+#else
+  #define MQTT_CONNECT_CALLBACK_SIGNATURE(c) void (*c)(int)
+#endif
+
+// MQTT_RECONNECT_CALLBACK_SIGNATURE : told of each automatic reconnection attempt as it starts.
+//  The argument is the number of attempts made since the connection was lost, this one included.
+#if defined(ESP8266) || defined(ESP32)
+  #define MQTT_RECONNECT_CALLBACK_SIGNATURE(c) std::function<void(uint16_t)> c
+#else
+  #define MQTT_RECONNECT_CALLBACK_SIGNATURE(c) void (*c)(uint16_t)
+#endif
+
+// MQTT_TOPIC_HANDLER_SIGNATURE : a handler in a TopicTable, with the arguments of
+//  MQTT_MESSAGE_CALLBACK_SIGNATURE. It is a plain function pointer on every board so
+//  that the table can be built at compile time.
+#define MQTT_TOPIC_HANDLER_SIGNATURE(c) void (*c)(const char *, uint16_t, const uint8_t *, unsigned int, uint8_t, boolean)
+
+// MQTT_MAX_TABLE_TOPICS : Maximum number of topics in a TopicTable
+#define MQTT_MAX_TABLE_TOPICS 64
+
+// A topic prepared once for repeated publishing, with its length and the two
+// byte length prefix MQTT sends ahead of it worked out up front. For a string
+// literal this happens at compile time:
+//
+//   constexpr TopicHandle temperature("sensors/temperature");
+//
+// The handle only points at the topic, which must outlive it
+class TopicHandle {
+public:
+  constexpr explicit TopicHandle(const char * topic)
+    : topic(topic), length(encodedLength(topic, 0)),
+      prefix{ (uint8_t) (encodedLength(topic, 0) >> 8), (uint8_t) (encodedLength(topic, 0) & 0xFF) } {}
+  constexpr TopicHandle(const char * topic, uint16_t length)
+    : topic(topic), length(length), prefix{ (uint8_t) (length >> 8), (uint8_t) (length & 0xFF) } {}
+
+  const char * topic;
+  uint16_t     length;
+  uint8_t      prefix[2];
+
+private:
+  static constexpr uint16_t encodedLength(const char * topic, uint16_t length)
+  {
+    return *topic ? encodedLength(topic + 1, length + 1) : length;
+  }
+};
+
+#define MQTT_ROUTER_NONE 0xFFFF
+
+// One level of a topic filter in a TopicRouter. A literal level is found through the
+// router's hash table, by its parent and its text, and is chained through next with the
+// others in its bucket. The + and # levels below a node are linked from it directly
+struct TopicRouterNode {
+  const char  * level;
+  uint16_t      length;
+  uint16_t      parent;
+  uint16_t      next;
+  uint16_t      single;     // the + level below, or MQTT_ROUTER_NONE
+  uint16_t      multi;      // the # level below, or MQTT_ROUTER_NONE
+  uint16_t      children;   // the number of levels below
+  MQTT_MESSAGE_CALLBACK_SIGNATURE(handler);
+};
+
+// Dispatches received messages to handlers registered per topic filter, including the +
+// and # wildcards. The filters are kept as a tree of levels in a fixed pool of nodes, one
+// per level not shared with another filter. The levels below a node are found with a hash
+// table of buckets, a power of two of them, rather than by comparing each in turn, so a
+// topic is matched in time that depends on its levels and the wildcard filters it meets,
+// not on the number of filters. Each node takes 16 bytes on AVR and each bucket 2 more.
+// The filters are not copied and must outlive the router.
+// Hand one to the client with setRouter().
+class TopicRouter {
+public:
+  // The number of buckets must be a power of two
+  TopicRouter(TopicRouterNode * nodes, uint16_t capacity, uint16_t * buckets, uint16_t bucketCount);
+
+  // Set the handler for a topic filter, replacing any it already has
+  // Returns false if the filter is invalid or there are not enough free nodes
+  boolean add(const char * filter, MQTT_MESSAGE_CALLBACK_SIGNATURE(handler));
+
+  // Remove the handler for a topic filter, freeing the nodes no other filter uses
+  // Returns false if the filter had no handler
+  boolean remove(const char * filter);
+
+  // Call the handler of every filter the topic matches, returning how many there were
+  uint16_t dispatch(const char * topic, uint16_t topicLength, const uint8_t * payload, unsigned int length, uint8_t qos, boolean retained);
+
+private:
+  TopicRouterNode * _nodes;
+  uint16_t          _capacity;
+  uint16_t          _used;
+  uint16_t          _free;
+  uint16_t        * _buckets;
+  uint16_t          _mask;
+  uint16_t          _single;    // the + and # levels at the top
+  uint16_t          _multi;
+
+  uint16_t    allocate(const char * level, uint16_t length, uint16_t parent);
+  uint16_t * wildcard(uint16_t     parent, char       kind);
+  uint16_t *    bucket(uint16_t     parent, const char * level, uint16_t length);
+  uint16_t        find(uint16_t     parent, const char * level, uint16_t length);
+  void           prune(uint16_t     index);
+  uint16_t       match(uint16_t     parent, const char * topic, const char * level, const char * end, 
+                       const uint8_t * payload, unsigned int length, uint8_t qos, boolean retained);
+  uint16_t     matched(uint16_t     index,  const char * topic, const char * next,  const char * end, 
+                       const uint8_t * payload, unsigned int length, uint8_t qos, boolean retained);
+};
+
+// The pool and hash table of a StaticTopicRouter, constructed ahead of the router that uses them
+template <uint16_t N>
+struct TopicRouterStorage {
+  // The smallest power of two buckets not fewer than the nodes
+  static constexpr uint32_t buckets(uint32_t count = 1)
+  {
+    return ((count >= N) || (count >= 0x8000)) ? count : buckets(count * 2);
+  }
+
+  TopicRouterNode nodes[N];
+  uint16_t        table[buckets()];
+};
+
+// A TopicRouter with a pool of N nodes, and a bucket for each, of its own
+template <uint16_t N>
+class StaticTopicRouter : private TopicRouterStorage<N>, public TopicRouter {
+public:
+  StaticTopicRouter() : TopicRouter(this->nodes, N, this->table, TopicRouterStorage<N>::buckets()) {}
+};
+
+// One topic of a TopicTable and the handler for messages received on it
+struct TopicEntry {
+  constexpr TopicEntry(const char * topic, MQTT_TOPIC_HANDLER_SIGNATURE(handler))
+    : topic(topic), length(TopicHandle(topic).length), handler(handler) {}
+
+  const char * topic;
+  uint16_t     length;
+  MQTT_TOPIC_HANDLER_SIGNATURE(handler);
+};
+
+// The hashes a TopicTable places its topics by: the FNV-1a hash of a topic, worked out
+// once, mixed with a seed for the slot
+class TopicHash {
+public:
+  static constexpr uint32_t start()
+  {
+    return 2166136261UL;
+  }
+
+  static constexpr uint32_t next(uint32_t hash, char c)
+  {
+    return (uint32_t) ((hash ^ (uint8_t) c) * 16777619UL);
+  }
+
+  static constexpr uint32_t of(const char * topic, uint16_t length, uint32_t hash = start())
+  {
+    return length ? of(topic + 1, length - 1, next(hash, *topic)) : hash;
+  }
+
+  // The finalizer of MurmurHash3, so that consecutive seeds give unrelated slots
+  static constexpr uint32_t mix(uint32_t hash, uint32_t seed)
+  {
+    return fold(fold(fold(hash ^ (seed * 0x9E3779B9UL), 16) * 0x85EBCA6BUL, 13) * 0xC2B2AE35UL, 16);
+  }
+
+private:
+  static constexpr uint32_t fold(uint32_t x, uint8_t shift)
+  {
+    return (uint32_t) (x ^ (x >> shift));
+  }
+};
+
+template <uint16_t... I> struct TopicIndices {};
+template <uint16_t N, uint16_t... I> struct TopicIndicesOf : TopicIndicesOf<N - 1, N - 1, I...> {};
+template <uint16_t... I> struct TopicIndicesOf<0, I...> { typedef TopicIndices<I...> type; };
+
+// The hash of each topic of a TopicTable, worked out once while it is built
+template <uint16_t N>
+struct TopicHashes {
+  template <uint16_t... E>
+  constexpr TopicHashes(const TopicEntry (&entries)[N], TopicIndices<E...>)
+    : hash{ TopicHash::of(entries[E].topic, entries[E].length)... } {}
+
+  uint32_t hash[N];
+};
+
+// Reached only when a TopicTable cannot be built, failing its compilation
+inline uint32_t TopicTableHasDuplicateTopics() { return 0; }
+inline uint32_t TopicTableFoundNoSeed() { return 0; }
+
+// A perfect hash of a fixed set of exact topics, worked out at compile time, that finds
+// the handler for a received topic with one hash and one comparison. Nothing is done to
+// build it when the sketch starts:
+//
+//   constexpr TopicTable<2> topics({ TopicEntry("home/light", onLight),
+//                                    TopicEntry("home/heating", onHeating) });
+//
+// On AVR a table, with 6 bytes per topic and a byte per slot, and its topics take RAM, as
+// every constant not placed in PROGMEM does. Both can be kept in flash instead, and the
+// table handed to the client with setTopicTable_P():
+//
+//   constexpr char light[] PROGMEM = "home/light";
+//   constexpr TopicTable<1> topics PROGMEM ({ TopicEntry(light, onLight) });
+//
+// A seed is searched for that gives every topic a slot of its own, among four slots per
+// topic rounded up to a power of two, which keeps the search short. Each topic is hashed
+// once, and a seed is tried against them all in one pass.
+// Hand one to the client with setTopicTable().
+template <uint16_t N>
+class TopicTable {
+  static_assert((N > 0) && (N <= MQTT_MAX_TABLE_TOPICS), "A TopicTable holds 1 to MQTT_MAX_TABLE_TOPICS topics");
+
+public:
+  static constexpr uint16_t SLOTS = (N <= 1) ? 4 : (N <= 2) ? 8 : (N <= 4) ? 16 : (N <= 8) ? 32 : 
+                                    (N <= 16) ? 64 : (N <= 32) ? 128 : 256;
+
+  constexpr TopicTable(const TopicEntry (&entries)[N])
+    : TopicTable(entries, TopicHashes<N>(entries, typename TopicIndicesOf<N>::type())) {}
+
+  uint32_t   seed;
+  uint8_t    slots[SLOTS];   // the index of the topic in each slot, plus one, or 0 for none
+  TopicEntry entries[N];
+
+private:
+  constexpr TopicTable(const TopicEntry (&entries)[N], const TopicHashes<N> & hashes)
+    : TopicTable(entries, hashes, findSeed(entries, hashes), typename TopicIndicesOf<N>::type(), typename TopicIndicesOf<SLOTS>::type()) {}
+
+  template <uint16_t... E, uint16_t... S>
+  constexpr TopicTable(const TopicEntry (&entries)[N], const TopicHashes<N> & hashes, uint32_t seed, TopicIndices<E...>, TopicIndices<S...>)
+    : seed(seed), slots{ slotOf(hashes, seed, S, 0)... }, entries{ entries[E]... } {}
+
+  static constexpr uint16_t slot(uint32_t hash, uint32_t seed)
+  {
+    return TopicHash::mix(hash, seed) & (SLOTS - 1);
+  }
+
+  static constexpr uint8_t slotOf(const TopicHashes<N> & hashes, uint32_t seed, uint16_t s, uint16_t i)
+  {
+    return (i == N) ? 0 : (slot(hashes.hash[i], seed) == s) ? i + 1 : slotOf(hashes, seed, s, i + 1);
+  }
+
+  static constexpr boolean same(const char * a, const char * b, uint16_t length)
+  {
+    return (length == 0) || ((*a == *b) && same(a + 1, b + 1, length - 1));
+  }
+
+  // Whether entry i differs from those after it. Topics are only compared when their hashes match
+  static constexpr boolean distinct(const TopicEntry (&entries)[N], const TopicHashes<N> & hashes, uint16_t i, uint16_t j)
+  {
+    return (j == N) || (((hashes.hash[i] != hashes.hash[j]) || (entries[i].length != entries[j].length) || 
+                         !same(entries[i].topic, entries[j].topic, entries[i].length)) && distinct(entries, hashes, i, j + 1));
+  }
+
+  static constexpr boolean distinct(const TopicEntry (&entries)[N], const TopicHashes<N> & hashes, uint16_t i)
+  {
+    return (i == N) || (distinct(entries, hashes, i, i + 1) && distinct(entries, hashes, i + 1));
+  }
+
+  // The slots taken so far are kept as a bitmap of four words, enough for 256 slots
+  static constexpr uint64_t bit(uint16_t s, uint8_t word)
+  {
+    return ((s >> 6) == word) ? ((uint64_t) 1 << (s & 63)) : 0;
+  }
+
+  static constexpr boolean works(const TopicHashes<N> & hashes, uint32_t seed, uint16_t i, 
+                                 uint64_t w0, uint64_t w1, uint64_t w2, uint64_t w3)
+  {
+    return (i == N) || place(hashes, seed, i, slot(hashes.hash[i], seed), w0, w1, w2, w3);
+  }
+
+  static constexpr boolean place(const TopicHashes<N> & hashes, uint32_t seed, uint16_t i, uint16_t s, 
+                                 uint64_t w0, uint64_t w1, uint64_t w2, uint64_t w3)
+  {
+    return !((w0 & bit(s, 0)) || (w1 & bit(s, 1)) || (w2 & bit(s, 2)) || (w3 & bit(s, 3))) && 
+           works(hashes, seed, i + 1, w0 | bit(s, 0), w1 | bit(s, 1), w2 | bit(s, 2), w3 | bit(s, 3));
+  }
+
+  // The first seed in [from, to) that works, or to if there is none. Halving the range
+  // keeps the recursion shallow
+  static constexpr uint32_t search(const TopicHashes<N> & hashes, uint32_t from, uint32_t to)
+  {
+    return (to - from == 1) ? (works(hashes, from, 0, 0, 0, 0, 0) ? from : to) : 
+           first(hashes, search(hashes, from, from + (to - from) / 2), from + (to - from) / 2, to);
+  }
+
+  static constexpr uint32_t first(const TopicHashes<N> & hashes, uint32_t found, uint32_t middle, uint32_t to)
+  {
+    return (found != middle) ? found : search(hashes, middle, to);
+  }
+
+  static constexpr uint32_t checked(uint32_t seed)
+  {
+    return (seed != 0x10000UL) ? seed : TopicTableFoundNoSeed();
+  }
+
+  static constexpr uint32_t findSeed(const TopicEntry (&entries)[N], const TopicHashes<N> & hashes)
+  {
+    return distinct(entries, hashes, 0) ? checked(search(hashes, 0, 0x10000UL)) : TopicTableHasDuplicateTopics();
+  }
+};
+
+template <uint16_t N> constexpr uint16_t TopicTable<N>::SLOTS;
+
+// What the client keeps of a TopicTable of any size. Only its address is taken, so the
+// table may be in PROGMEM, in which case progmem is set and it is read from there
+class TopicTableRef {
+public:
+  constexpr TopicTableRef() : seed(nullptr), mask(0), slots(nullptr), entries(nullptr), progmem(false) {}
+  template <uint16_t N>
+  constexpr TopicTableRef(const TopicTable<N> & table, boolean progmem = false)
+    : seed(&table.seed), mask(TopicTable<N>::SLOTS - 1), slots(table.slots), entries(table.entries), progmem(progmem) {}
+
+  // The entry for a topic, or nullptr if the table does not have it. For a table in
+  // PROGMEM the entry is there too
+  const TopicEntry * find(const char * topic, uint16_t length) const;
+
+  // Call the handler for the topic, returning false if the table does not have it
+  boolean dispatch(const char * topic, uint16_t topicLength, const uint8_t * payload, unsigned int length, uint8_t qos, boolean retained) const;
+
+  const uint32_t   * seed;
+  uint16_t           mask;
+  const uint8_t    * slots;
+  const TopicEntry * entries;
+  boolean            progmem;
+};
+
 class PubSubClient : public Print {
 private:
   int           _state;
   Client      * _client;
+  VectoredClient * _vclient;
+  WaitableClient * _wclient;
+  uint8_t       _waitStrategy;
   Stream      * _stream;
   MQTT_CALLBACK_SIGNATURE(_callback);
-  
+  MQTT_MESSAGE_CALLBACK_SIGNATURE(_messageCallback);
+  MQTT_PUBLISH_CALLBACK_SIGNATURE(_publishCallback);
+  MQTT_SUBSCRIBE_CALLBACK_SIGNATURE(_subscribeCallback);
+  MQTT_CONNECT_CALLBACK_SIGNATURE(_connectCallback);
+  MQTT_RECONNECT_CALLBACK_SIGNATURE(_reconnectCallback);
+  TopicRouter * _router;
+  TopicTableRef _topicTable;
+
   IPAddress     _ip;
   const char  * _domain;
   uint16_t      _port;
 
-  uint8_t       buffer[MQTT_MAX_PACKET_SIZE];
+  // Inbound packets are assembled in rxBuffer while outbound ones are built in txBuffer,
+  // so sending, even from inside the callback, never disturbs the received packet.
+  // They are allocated on the first connect unless set beforehand.
+  uint8_t     * rxBuffer;
+  uint8_t     * txBuffer;
+  uint16_t      rxBufferSize;
+  uint16_t      txBufferSize;
+  boolean       bufferOwned;
   uint16_t      nextMsgId;
   unsigned long lastOutActivity;
   unsigned long lastInActivity;
   bool          pingOutstanding;
 
-  uint32_t     readPacket(uint8_t    * lengthLength);
-  boolean        readByte(uint8_t    * result);
-  boolean        readByte(uint8_t    * result, uint16_t   * index);
+  // The parameters of the last connection attempt, which automatic reconnection uses again
+  const char  * _connectId;
+  const char  * _connectUser;
+  const char  * _connectPass;
+  const char  * _willTopic;
+  const char  * _willMessage;
+  uint8_t       _willQos;
+  boolean       _willRetain;
+  boolean       _cleanSession;
+
+  // Automatic reconnection: the backoff doubles from _reconnectMin up to _reconnectMax with
+  // each attempt, and the next one is due _reconnectWait after _reconnectStart when pending
+  boolean       _autoReconnect;
+  boolean       _reconnectPending;
+  uint16_t      _reconnectAttempts;
+  unsigned long _reconnectMin;
+  unsigned long _reconnectMax;
+  unsigned long _reconnectBackoff;
+  unsigned long _reconnectStart;
+  unsigned long _reconnectWait;
+
+  // Receive state, kept across calls to loop() so a partial packet never blocks
+  uint8_t       _rxState;
+  uint8_t       _rxShift;
+  uint8_t       _rxLengthLength;
+  uint16_t      _rxPos;
+  uint32_t      _rxLength;
+  uint32_t      _rxRead;
+
+  // Outbound bytes staged at the start of txBuffer, whether staging any of them failed
+  // and whether whole packets are being collected until flushBatch()
+  uint16_t      _txPos;
+  boolean       _txFailed;
+  boolean       _batching;
+
+  // A packet waiting for acknowledgement, in the slot given by its id % _window.
+  // A message's packet is kept in the matching txBufferSize slot of _store, which is
+  // allocated with the first one; other requests keep no copy and have a length of 0
+  struct Inflight {
+    uint16_t      msgId;  // 0 while the slot is free
+    uint8_t       ack;    // Packet type expected next
+    uint16_t      length;
+    unsigned long sent;
+  };
+
+  // The in-flight table, with a bit set in _free for each free slot in the window
+  Inflight      _inflight[MQTT_MAX_INFLIGHT];
+  uint32_t      _free;
+  // Ids of received QoS 2 messages waiting for PUBREL, 0 where free
+  uint16_t      _inbound[MQTT_MAX_INBOUND];
+  uint8_t     * _store;
+  boolean       _storeOwned;
+
+  // Topic filters subscribed to, copied when first subscribed to, with room for _subSize.
+  // Those from _resubscribe on are waiting, in order, for a SUBSCRIBE or, where their
+  // qos is MQTT_SUB_REMOVE, an UNSUBSCRIBE to be sent, for lack of free in-flight slots.
+  // Those before it that were sent in a request not yet acknowledged have MQTT_SUB_SENT set
+  char       ** _subTopics;
+  uint8_t     * _subQos;
+  uint16_t      _subCount;
+  uint16_t      _subSize;
+  uint16_t      _resubscribe;
+  uint8_t       _window;
+  uint16_t      _lastMsgId;
+
+  boolean   readAvailable(uint32_t   * length, uint8_t    * lengthLength);
+  boolean continueConnect();
+  void         endConnect(int          state);
+  void          reconnect();
+  void               wait(uint16_t     polls);
   boolean           write(uint8_t      header, uint8_t    * buf, uint16_t length);
+  boolean     writeBuffer(const uint8_t * buf, size_t length);
+  boolean     writeVector(const MQTTIOVec * iov, uint8_t count);
+  boolean     flushBuffer();
+  boolean         reserve(size_t       size);
+  uint16_t          stage(uint8_t      header, uint8_t    * buf, uint16_t length, uint32_t extra);
+  boolean    writeControl(const uint8_t * packet, uint16_t length);
   uint16_t    writeString(const char * string, uint8_t    * buf, uint16_t pos);
   boolean check_and_write(uint16_t   * length, const char * string);
+  boolean    writeFilters(uint8_t      type,   const char * const * topics, const uint8_t * qos, size_t count);
+  size_t      packFilters(uint8_t      type,   const char * const * topics, size_t count);
+  boolean     checkFilters(uint8_t      type,   const char * const * topics, const uint8_t * qos, size_t count);
+  int    findSubscription(const char * topic);
+  boolean queueSubscription(const char * topic, uint8_t qos);
+  void   removeSubscriptions(uint16_t    index,  uint16_t   count);
+  boolean     resubscribe();
+  boolean     subscribing();
+  void     settleSubscriptions();
+  void    requeueSubscriptions();
+  Inflight * allocateInflight(uint8_t  ack);
+  Inflight *   findInflight(uint16_t     msgId);
+  void      releaseInflight(Inflight   * inflight);
+  uint16_t *    findInbound(uint16_t     msgId);
+  void       endInflight(boolean      delivered);
+  void        lostInflight(Inflight   * inflight);
+  void         retransmit(unsigned long t, boolean all);
 
   // Build up the header ready to send
   // Returns the size of the header
   // Note: the header is built at the end of the first MQTT_MAX_HEADER_SIZE bytes, so will start
   //       (MQTT_MAX_HEADER_SIZE - <returned size>) bytes into the buffer
-  size_t buildHeader(uint8_t header, uint8_t * buf, uint16_t length);
+  size_t buildHeader(uint8_t header, uint8_t * buf, uint32_t length);
 
 public:
   PubSubClient();
   PubSubClient(Client & client);
+  PubSubClient(Client & client, uint8_t * rxBuffer, uint8_t * txBuffer, uint16_t size);
+  PubSubClient(Client & client, uint8_t * rxBuffer, uint16_t rxSize, uint8_t * txBuffer, uint16_t txSize);
   PubSubClient(IPAddress, uint16_t, Client & client);
   PubSubClient(IPAddress, uint16_t, Client & client, Stream & stream);
   PubSubClient(IPAddress, uint16_t, MQTT_CALLBACK_SIGNATURE(callback), Client & client);
@@ -128,18 +681,70 @@ public:
   PubSubClient(const char *, uint16_t, Client & client, Stream & stream);
   PubSubClient(const char *, uint16_t, MQTT_CALLBACK_SIGNATURE(callback), Client & client);
   PubSubClient(const char *, uint16_t, MQTT_CALLBACK_SIGNATURE(callback), Client & client, Stream & stream);
+  ~PubSubClient();
+
+  // A client owns its buffers, in-flight store and subscriptions, so it cannot be copied
+  PubSubClient(const PubSubClient &) = delete;
+  PubSubClient & operator=(const PubSubClient &) = delete;
 
   PubSubClient & setServer(IPAddress    ip,     uint16_t port);
   PubSubClient & setServer(uint8_t    * ip,     uint16_t port);
   PubSubClient & setServer(const char * domain, uint16_t port);
 
   PubSubClient & setCallback(MQTT_CALLBACK_SIGNATURE(callback));
-    
+
+  // Set a callback that is handed the topic and payload in place, without the
+  // copy needed to null-terminate the topic for the callback set with setCallback.
+  // Both callbacks are called if both are set.
+  PubSubClient & setMessageCallback(MQTT_MESSAGE_CALLBACK_SIGNATURE(callback));
+
+  // Dispatch received messages to the handlers of a TopicRouter, ahead of either callback
+  PubSubClient & setRouter(TopicRouter & router);
+
+  // Dispatch received messages on the topics of a TopicTable to their handlers, ahead of a router
+  PubSubClient & setTopicTable(const TopicTableRef & table);
+  // The same for a TopicTable placed in PROGMEM, along with each of its topics
+  PubSubClient & setTopicTable_P(const TopicTableRef & table);
+
   PubSubClient & setClient(Client & client);
+
+  // Use a client that also supports vectored writes, so publish() sends the
+  // caller's payload without copying it into the transmit buffer
+  PubSubClient & setClient(Client & client, VectoredClient & vectored);
    
+  // Choose how connect() waits for the network: MQTT_WAIT_SPIN, MQTT_WAIT_YIELD (the default)
+  // or MQTT_WAIT_BLOCK, which needs a client registered with the other form and otherwise
+  // acts as MQTT_WAIT_YIELD
+  PubSubClient & setWaitStrategy(uint8_t strategy);
+
+  // Block in the wait() of a client that supports it, which costs no CPU while waiting.
+  // Waits never outlast nextDeadline(), so timeouts are still noticed
+  PubSubClient & setWaitStrategy(WaitableClient & waitable);
+
   PubSubClient & setStream(Stream & stream);
   void removeStream();
 
+  // Set the size of the receive and transmit buffers, replacing the default of
+  // MQTT_MAX_PACKET_SIZE bytes. rxSize limits the size of inbound packets and txSize
+  // that of outbound ones.
+  // Returns false if the buffers could not be allocated, leaving the old ones in place, or
+  // if they are in use: part way through receiving a packet, with messages in flight or
+  // with packets staged to send, as while batching or connecting. A store handed to
+  // setInflightWindow() is kept, so the transmit buffer cannot change size while there is one
+  boolean setBufferSize(uint16_t size);
+  boolean setBufferSize(uint16_t rxSize, uint16_t txSize);
+
+  // Use the caller's buffers instead of allocating.
+  // They must stay valid for as long as the client uses them. Refused, as with
+  // setBufferSize(), while the current buffers are in use
+  boolean setBuffer(uint8_t * rxBuffer, uint8_t * txBuffer, uint16_t size);
+  boolean setBuffer(uint8_t * rxBuffer, uint16_t rxSize, uint8_t * txBuffer, uint16_t txSize);
+
+  // Returns the smaller of the two buffer sizes
+  uint16_t getBufferSize();
+  uint16_t getRxBufferSize();
+  uint16_t getTxBufferSize();
+
   boolean connect(const char * id, 
                   const char * user         = nullptr, 
                   const char * pass         = nullptr, 
@@ -158,6 +763,43 @@ public:
     return connect(id, nullptr, nullptr, willTopic, willQos, willRetain, willMessage, true);
   }
 
+  // Start connecting without waiting for the server. The CONNECT packet is built straight
+  // away, so the strings need not outlive the call; it is sent once the network connection
+  // is open and loop() then waits for the CONNACK. state() is MQTT_CONNECTING and then
+  // MQTT_CONNECT_SENT until the attempt ends, when the callback set with
+  // setConnectCallback() is told the outcome. The network client's own connect() is
+  // called from here, so only one that returns before the connection opens avoids blocking.
+  // Returns false if the attempt failed at once
+  boolean beginConnect(const char * id, 
+                       const char * user         = nullptr, 
+                       const char * pass         = nullptr, 
+                       const char * willTopic    = nullptr, 
+                       uint8_t      willQos      = 0, 
+                       boolean      willRetain   = false, 
+                       const char * willMessage  = nullptr, 
+                       boolean      cleanSession = true);
+
+  // Whether a connection attempt is still under way
+  boolean connecting();
+
+  // Set a callback that is told how each connection attempt ended
+  PubSubClient & setConnectCallback(MQTT_CONNECT_CALLBACK_SIGNATURE(callback));
+
+  // Have loop() reconnect by itself, with the parameters of the last connect() or beginConnect(),
+  // whenever the connection is lost or an attempt fails, but not after disconnect(). The strings
+  // passed to connect() must then stay valid. Each attempt waits a random time between half and
+  // all of a backoff that starts at minDelay milliseconds and doubles with each attempt up to
+  // maxDelay, so that clients that lost the same server do not all return at once. The wait
+  // mixes the client id and micros() into random(); calling randomSeed() in setup() with
+  // something that differs between boards, such as analogRead() of an unconnected pin,
+  // spreads them further. Attempts do not block and end as with beginConnect()
+  PubSubClient & setAutoReconnect(boolean       enabled, 
+                                  unsigned long minDelay = MQTT_RECONNECT_MIN_DELAY, 
+                                  unsigned long maxDelay = MQTT_RECONNECT_MAX_DELAY);
+
+  // Set a callback that is told as each automatic reconnection attempt starts
+  PubSubClient & setReconnectCallback(MQTT_RECONNECT_CALLBACK_SIGNATURE(callback));
+
   void disconnect();
 
   boolean publish(const char * topic, const uint8_t * payload, unsigned int plength, boolean retained = false);
@@ -166,23 +808,75 @@ public:
     return publish(topic, (const uint8_t *) payload, strlen(payload), retained);
   }
 
+  // Publish with QoS 0, 1 or 2. A QoS 1 or 2 message is kept until the server acknowledges it and
+  // is sent again, marked as a duplicate, if that takes longer than MQTT_RETRY_INTERVAL. Up to the
+  // in-flight window of them can be outstanding at once; publish() returns false while it is full.
+  // Its message id is available from getLastMessageId() and its outcome is reported to the
+  // callback set with setPublishCallback()
+  boolean publish(const char * topic, const uint8_t * payload, unsigned int plength, uint8_t qos, boolean retained);
+  inline boolean publish(const char * topic, const char * payload, uint8_t qos, boolean retained)
+  {
+    return publish(topic, (const uint8_t *) payload, strlen(payload), qos, retained);
+  }
+
+  // Publish to a prepared topic, which is copied into the buffer in one go, or
+  // not at all when the payload is sent through a vectored client
+  boolean publish(const TopicHandle & topic, const uint8_t * payload, unsigned int plength, boolean retained = false);
+  inline boolean publish(const TopicHandle & topic, const char * payload, boolean retained = false)
+  {
+    return publish(topic, (const uint8_t *) payload, strlen(payload), retained);
+  }
+  boolean publish(const TopicHandle & topic, const uint8_t * payload, unsigned int plength, uint8_t qos, boolean retained);
+  inline boolean publish(const TopicHandle & topic, const char * payload, uint8_t qos, boolean retained)
+  {
+    return publish(topic, (const uint8_t *) payload, strlen(payload), qos, retained);
+  }
+
+  // Message id given to the last message published with QoS 1 or 2, or the last
+  // subscribe or unsubscribe request
+  uint16_t getLastMessageId();
+
+  // Set a callback that is told when each QoS 1 or 2 message has been acknowledged
+  PubSubClient & setPublishCallback(MQTT_PUBLISH_CALLBACK_SIGNATURE(callback));
+
+  // Set how many packets may wait for acknowledgement at once, up to MQTT_MAX_INFLIGHT (the
+  // default). A copy of each QoS 1 and 2 message is kept in a slot the size of the transmit
+  // buffer, allocated when first needed or, to fix memory use up front, handed over as store:
+  // window * getTxBufferSize() bytes, so set after the buffer size. The store is kept by
+  // later buffer changes, including the default allocation of connect(), that leave the
+  // transmit buffer the same size, and those that do not are refused.
+  // Returns false if out of range or while packets are still waiting
+  boolean setInflightWindow(uint8_t window);
+  boolean setInflightWindow(uint8_t window, uint8_t * store);
+
+  // Number of packets still waiting for acknowledgement: QoS 1 and 2 messages, and
+  // subscribe and unsubscribe requests
+  uint8_t getInflightCount();
+
   boolean publish_P(const char * topic, const uint8_t * payload, unsigned int plength, boolean retained);
   inline boolean publish_P(const char * topic, const char * payload, boolean retained)
   {
     return publish_P(topic, (const uint8_t *) payload, strlen(payload), retained);
   }
 
+  // Publish a QoS 0 message that has already been framed, fixed header and all, for example
+  // by a PublishQueue on another thread. It is staged while batching like any other packet.
+  // Returns false for anything but a QoS 0 PUBLISH
+  boolean publishFramed(const uint8_t * packet, size_t length);
+
   // Start to publish a message.
   // This API:
   //   beginPublish(...)
   //   one or more calls to write(...)
   //   endPublish()
   // Allows for arbitrarily large payloads to be sent without them having to be copied into
-  // a new buffer and held in memory at one time
+  // a new buffer and held in memory at one time. The payload is collected in the transmit
+  // buffer and sent each time it fills up, so small writes such as print() still leave as
+  // full-sized writes to the network client
   // Returns 1 if the message was started successfully, 0 if there was an error
   boolean beginPublish(const char* topic, unsigned int plength, boolean retained);
 
-  // Finish off this publish message (started with beginPublish)
+  // Finish off this publish message (started with beginPublish), sending what is left of it
   // Returns true if the packet was sent successfully, false if there was an error
   boolean endPublish();
 
@@ -193,10 +887,57 @@ public:
   // Returns the number of bytes written
   virtual size_t write(const uint8_t * buffer, size_t size);
 
+  // Collect outbound packets (publish, subscribe, unsubscribe and acks) back to back in the
+  // transmit buffer rather than writing each one to the network client as it is made.
+  // They are sent together when the buffer fills up, before the client blocks waiting for
+  // the network, and by flushBatch()
+  void beginBatch();
+
+  // Send everything collected since beginBatch() and go back to writing each packet as it is made
+  // Returns true if everything was sent successfully
+  boolean flushBatch();
+
+  // Whether packets are being collected since beginBatch()
+  boolean batching();
+
   boolean subscribe(const char * topic);
   boolean subscribe(const char * topic, uint8_t qos);
   boolean unsubscribe(const char * topic);
+
+  // Topic filters subscribed to are remembered, with room made for as many as needed, and
+  // subscribed to again, packed into as few packets as possible, when connect() finds the
+  // server has not kept the session. Requests still unacknowledged when the connection was
+  // lost are sent again even if it has. Unsubscribing forgets a filter once acknowledged.
+  // Should there be no memory left to remember a filter, it is sent at once if there is a
+  // free in-flight slot for it, or the call returns false, but it will not be sent again.
+
+  // Subscribe to, or unsubscribe from, count topic filters at once. As many as fit in the
+  // transmit buffer go in each packet, using one in-flight slot each, and the packets are
+  // sent together. Those there are no free in-flight slots for yet are queued, in order, and
+  // sent from loop() as SUBACKs and UNSUBACKs free slots. qos gives the QoS for each filter,
+  // or 0 for all of them if nullptr. Returns false, without sending or queueing anything, if
+  // a filter is invalid or too long, or if not connected
+  boolean subscribe(const char * const * topics, const uint8_t * qos, size_t count);
+  boolean unsubscribe(const char * const * topics, size_t count);
+
+  // Set a callback that is told the outcome of each subscribe and unsubscribe request,
+  // matched by the message id from getLastMessageId(). Any number can be outstanding,
+  // up to the in-flight window, without waiting for each one
+  PubSubClient & setSubscribeCallback(MQTT_SUBSCRIBE_CALLBACK_SIGNATURE(callback));
+
   boolean loop();
+
+  // The millis() time by which loop() must next run to keep the connection alive, either to
+  // send a ping or to give up waiting for the answer to one
+  unsigned long nextKeepalive();
+
+  // Milliseconds the caller may sleep before loop() next needs to run, or 0 if it should run
+  // now. Covers keepalive pings, resending unacknowledged messages, connection and packet
+  // timeouts and automatic reconnection. Data arriving needs loop() sooner, so a host can wait
+  // for the socket to become readable (or writable, while connecting()) with this as the
+  // timeout. Returns MQTT_NO_DEADLINE when only arriving data, if anything, needs attention
+  unsigned long nextDeadline();
+
   boolean connected();
   int state();
 };
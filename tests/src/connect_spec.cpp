@@ -3,6 +3,7 @@
 #include "Buffer.h"
 #include "BDDTest.h"
 #include "trace.h"
+#include <unistd.h>
 
 
 byte server[] = { 172, 16, 0, 2 };
@@ -11,6 +12,62 @@ void callback(char* topic, byte* payload, unsigned int length) {
   // handle message arrived
 }
 
+int connectCount = 0;
+int lastConnectState = 0xFF;
+
+void connect_callback(int state) {
+    connectCount++;
+    lastConnectState = state;
+}
+
+int reconnectCount = 0;
+uint16_t lastAttempt = 0;
+
+void reconnect_callback(uint16_t attempt) {
+    reconnectCount++;
+    lastAttempt = attempt;
+}
+
+void reset_connect_callback() {
+    connectCount = 0;
+    lastConnectState = 0xFF;
+    reconnectCount = 0;
+    lastAttempt = 0;
+}
+
+// A client whose connect() returns before the connection opens
+class PendingShimClient : public ShimClient {
+public:
+    virtual int connect(IPAddress ip, uint16_t port) {
+        ShimClient::connect(ip, port);
+        setConnected(false);
+        return 1;
+    }
+};
+
+// A pending client that can be waited on, which opens the connection and then
+// answers the CONNECT as it is waited on for each in turn
+class WaitingShimClient : public PendingShimClient, public WaitableClient {
+public:
+    int writableWaits = 0;
+    int readableWaits = 0;
+    unsigned long lastTimeout = 0;
+
+    virtual boolean wait(boolean writable, unsigned long timeout) {
+        lastTimeout = timeout;
+        if (writable) {
+            writableWaits++;
+            setConnected(true);
+        }
+        else {
+            readableWaits++;
+            byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+            respond(connack,4);
+        }
+        return true;
+    }
+};
+
 
 int test_connect_fails_no_network() {
     IT("fails to connect if underlying client doesn't connect");
@@ -280,6 +337,365 @@ int test_connect_disconnect_connect() {
     END_IT
 }
 
+int test_begin_connect() {
+    IT("connects without waiting for the server");
+    reset_connect_callback();
+    ShimClient shimClient;
+
+    shimClient.setAllowConnect(true);
+    byte connect[] = {0x10,0x18,0x0,0x4,0x4d,0x51,0x54,0x54,0x4,0x2,0x0,0xf,0x0,0xc,0x63,0x6c,0x69,0x65,0x6e,0x74,0x5f,0x74,0x65,0x73,0x74,0x31};
+    shimClient.expect(connect,26);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    client.setConnectCallback(connect_callback);
+
+    int rc = client.beginConnect((char*)"client_test1");
+    IS_TRUE(rc);
+    IS_TRUE(client.state() == MQTT_CONNECT_SENT);
+    IS_TRUE(client.connecting());
+    IS_FALSE(client.connected());
+    IS_FALSE(client.publish((char*)"topic",(char*)"payload"));
+
+    rc = client.loop();
+    IS_FALSE(rc);
+    IS_TRUE(client.state() == MQTT_CONNECT_SENT);
+    IS_TRUE(connectCount == 0);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(client.state() == MQTT_CONNECTED);
+    IS_FALSE(client.connecting());
+    IS_TRUE(client.connected());
+    IS_TRUE(connectCount == 1);
+    IS_TRUE(lastConnectState == MQTT_CONNECTED);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_begin_connect_pending_network() {
+    IT("sends the connect packet once the network connection opens");
+    reset_connect_callback();
+    PendingShimClient shimClient;
+
+    shimClient.setAllowConnect(true);
+    PubSubClient client(server, 1883, callback, shimClient);
+
+    int rc = client.beginConnect((char*)"client_test1");
+    IS_TRUE(rc);
+    IS_TRUE(client.state() == MQTT_CONNECTING);
+    IS_TRUE(shimClient.writes() == 0);
+
+    rc = client.loop();
+    IS_FALSE(rc);
+    IS_TRUE(client.state() == MQTT_CONNECTING);
+    IS_TRUE(shimClient.writes() == 0);
+
+    byte connect[] = {0x10,0x18,0x0,0x4,0x4d,0x51,0x54,0x54,0x4,0x2,0x0,0xf,0x0,0xc,0x63,0x6c,0x69,0x65,0x6e,0x74,0x5f,0x74,0x65,0x73,0x74,0x31};
+    shimClient.expect(connect,26);
+    shimClient.setConnected(true);
+
+    rc = client.loop();
+    IS_FALSE(rc);
+    IS_TRUE(client.state() == MQTT_CONNECT_SENT);
+    IS_TRUE(shimClient.writes() == 1);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(client.state() == MQTT_CONNECTED);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_connect_wait_block() {
+    IT("blocks on the client while connect() waits for the network");
+    reset_connect_callback();
+    WaitingShimClient shimClient;
+
+    shimClient.setAllowConnect(true);
+    PubSubClient client(server, 1883, callback, shimClient);
+    client.setWaitStrategy(shimClient);
+
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+    IS_TRUE(client.state() == MQTT_CONNECTED);
+    IS_TRUE(shimClient.writableWaits == 1);
+    IS_TRUE(shimClient.readableWaits == 1);
+
+    // Each wait ends by the time the attempt would time out
+    IS_TRUE(shimClient.lastTimeout > 0);
+    IS_TRUE(shimClient.lastTimeout <= MQTT_SOCKET_TIMEOUT * 1000UL + 1);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_connect_wait_spin() {
+    IT("polls without waiting on the client with the spin strategy");
+    reset_connect_callback();
+    WaitingShimClient shimClient;
+
+    shimClient.setAllowConnect(true);
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    client.setWaitStrategy(shimClient);
+    client.setWaitStrategy(MQTT_WAIT_SPIN);
+
+    int rc = client.beginConnect((char*)"client_test1");
+    IS_TRUE(rc);
+    shimClient.setConnected(true);
+
+    rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+    IS_TRUE(shimClient.writableWaits == 0);
+    IS_TRUE(shimClient.readableWaits == 0);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_begin_connect_fails_no_network() {
+    IT("reports a connection that cannot be started");
+    reset_connect_callback();
+    ShimClient shimClient;
+    shimClient.setAllowConnect(false);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    client.setConnectCallback(connect_callback);
+
+    int rc = client.beginConnect((char*)"client_test1");
+    IS_FALSE(rc);
+    IS_TRUE(client.state() == MQTT_CONNECT_FAILED);
+    IS_FALSE(client.connecting());
+    IS_TRUE(connectCount == 1);
+    IS_TRUE(lastConnectState == MQTT_CONNECT_FAILED);
+
+    END_IT
+}
+
+int test_begin_connect_fails_on_bad_rc() {
+    IT("reports a connection the server refuses");
+    reset_connect_callback();
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    client.setConnectCallback(connect_callback);
+
+    int rc = client.beginConnect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x05 };
+    shimClient.respond(connack,4);
+
+    rc = client.loop();
+    IS_FALSE(rc);
+    IS_TRUE(client.state() == MQTT_CONNECT_UNAUTHORIZED);
+    IS_FALSE(shimClient.connected());
+    IS_TRUE(connectCount == 1);
+    IS_TRUE(lastConnectState == MQTT_CONNECT_UNAUTHORIZED);
+
+    END_IT
+}
+
+int test_begin_connect_disconnect() {
+    IT("abandons a connection that has not opened");
+    PendingShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+
+    int rc = client.beginConnect((char*)"client_test1");
+    IS_TRUE(rc);
+    IS_TRUE(client.state() == MQTT_CONNECTING);
+
+    client.disconnect();
+    IS_TRUE(client.state() == MQTT_DISCONNECTED);
+    IS_TRUE(shimClient.writes() == 0);
+
+    rc = client.loop();
+    IS_FALSE(rc);
+    IS_TRUE(shimClient.writes() == 0);
+
+    END_IT
+}
+
+int test_auto_reconnect() {
+    IT("reconnects by itself after losing the connection");
+    reset_connect_callback();
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    client.setAutoReconnect(true, 0, 0);
+    client.setReconnectCallback(reconnect_callback);
+    client.setConnectCallback(connect_callback);
+
+    int rc = client.connect((char*)"client_test1", (char*)"user", (char*)"pass");
+    IS_TRUE(rc);
+    IS_TRUE(connectCount == 1);
+
+    shimClient.setConnected(false);
+    rc = client.loop();
+    IS_FALSE(rc);
+    IS_TRUE(client.state() == MQTT_CONNECTION_LOST);
+
+    // Sent with the parameters of the last connect()
+    byte connect[] = {0x10,0x24,0x0,0x4,0x4d,0x51,0x54,0x54,0x4,0xc2,0x0,0xf,0x0,0xc,0x63,0x6c,0x69,0x65,0x6e,0x74,0x5f,0x74,0x65,0x73,0x74,0x31,0x0,0x4,0x75,0x73,0x65,0x72,0x0,0x4,0x70,0x61,0x73,0x73};
+    shimClient.expect(connect,0x26);
+    shimClient.respond(connack,4);
+
+    rc = client.loop();
+    IS_FALSE(rc);
+    IS_TRUE(reconnectCount == 1);
+    IS_TRUE(lastAttempt == 1);
+    IS_TRUE(client.state() == MQTT_CONNECTED);
+    IS_TRUE(connectCount == 2);
+
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(reconnectCount == 1);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_auto_reconnect_protocol_error() {
+    IT("reconnects by itself after dropping a malformed packet");
+    reset_connect_callback();
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    client.setAutoReconnect(true, 0, 0);
+    client.setReconnectCallback(reconnect_callback);
+
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    // A remaining length longer than four bytes
+    byte invalid[] = { 0x30, 0xff, 0xff, 0xff, 0xff, 0xff };
+    shimClient.respond(invalid,6);
+    rc = client.loop();
+    IS_FALSE(rc);
+    IS_TRUE(client.state() == MQTT_CONNECTION_LOST);
+    IS_TRUE(client.nextDeadline() != MQTT_NO_DEADLINE);
+
+    shimClient.respond(connack,4);
+    for (int i = 0; (i < 3) && !client.connected(); i++) {
+        client.loop();
+    }
+    IS_TRUE(reconnectCount == 1);
+    IS_TRUE(client.state() == MQTT_CONNECTED);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_auto_reconnect_backoff() {
+    IT("waits longer between failed reconnection attempts (takes 5 seconds)");
+    reset_connect_callback();
+    ShimClient shimClient;
+    shimClient.setAllowConnect(false);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    client.setAutoReconnect(true, 2000, 4000);
+    client.setReconnectCallback(reconnect_callback);
+
+    int rc = client.connect((char*)"client_test1");
+    IS_FALSE(rc);
+
+    // The first attempt waits between 1 and 2 seconds
+    rc = client.loop();
+    IS_FALSE(rc);
+    rc = client.loop();
+    IS_FALSE(rc);
+    IS_TRUE(reconnectCount == 0);
+
+    for (int i = 0; (i < 4) && (reconnectCount == 0); i++) {
+        sleep(1);
+        client.loop();
+    }
+    IS_TRUE(reconnectCount == 1);
+    IS_TRUE(client.state() == MQTT_CONNECT_FAILED);
+
+    // The second between 2 and 4
+    client.loop();
+    sleep(1);
+    client.loop();
+    IS_TRUE(reconnectCount == 1);
+
+    shimClient.setAllowConnect(true);
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    for (int i = 0; (i < 4) && (reconnectCount == 1); i++) {
+        sleep(1);
+        client.loop();
+    }
+    IS_TRUE(reconnectCount == 2);
+    IS_TRUE(lastAttempt == 2);
+    IS_TRUE(client.connected());
+
+    END_IT
+}
+
+int test_auto_reconnect_not_after_disconnect() {
+    IT("does not reconnect by itself after disconnecting");
+    reset_connect_callback();
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    client.setAutoReconnect(true, 0, 0);
+    client.setReconnectCallback(reconnect_callback);
+
+    // Nor before connecting for the first time
+    int rc = client.loop();
+    IS_FALSE(rc);
+    rc = client.loop();
+    IS_FALSE(rc);
+    IS_TRUE(reconnectCount == 0);
+
+    rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    client.disconnect();
+
+    rc = client.loop();
+    IS_FALSE(rc);
+    rc = client.loop();
+    IS_FALSE(rc);
+    IS_TRUE(reconnectCount == 0);
+    IS_FALSE(shimClient.connected());
+
+    END_IT
+}
+
 int main()
 {
     SUITE("Connect");
@@ -298,5 +714,19 @@ int main()
     test_connect_with_will();
     test_connect_with_will_username_password();
     test_connect_disconnect_connect();
+
+    test_begin_connect();
+    test_begin_connect_pending_network();
+    test_begin_connect_fails_no_network();
+    test_begin_connect_fails_on_bad_rc();
+    test_begin_connect_disconnect();
+
+    test_connect_wait_block();
+    test_connect_wait_spin();
+
+    test_auto_reconnect();
+    test_auto_reconnect_protocol_error();
+    test_auto_reconnect_backoff();
+    test_auto_reconnect_not_after_disconnect();
     FINISH
 }
@@ -172,6 +172,135 @@ int test_keepalive_disconnects_hung() {
     END_IT
 }
 
+int test_deadline_idle() {
+    IT("reports the keepalive ping as the next deadline of an idle connection");
+
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    IS_TRUE(client.nextDeadline() == MQTT_NO_DEADLINE);
+
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    unsigned long wait = client.nextDeadline();
+    IS_TRUE(wait <= MQTT_KEEPALIVE * 1000UL + 1);
+    IS_TRUE(wait > (MQTT_KEEPALIVE - 1) * 1000UL);
+
+    // Data waiting to be read needs loop() at once
+    byte publish[] = {0x30,0xe,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    shimClient.respond(publish,16);
+    IS_TRUE(client.nextDeadline() == 0);
+
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(client.nextDeadline() > 0);
+
+    client.disconnect();
+    IS_TRUE(client.nextDeadline() == MQTT_NO_DEADLINE);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_deadline_inflight() {
+    IT("reports resending an unacknowledged message as the next deadline");
+
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    rc = client.publish((char*)"topic",(char*)"payload",1,false);
+    IS_TRUE(rc);
+
+    unsigned long wait = client.nextDeadline();
+    IS_TRUE(wait <= MQTT_RETRY_INTERVAL * 1000UL);
+    IS_TRUE(wait > (MQTT_RETRY_INTERVAL - 1) * 1000UL);
+
+    byte puback[] = { 0x40, 0x02, 0x00, (byte)client.getLastMessageId() };
+    shimClient.respond(puback,4);
+    rc = client.loop();
+    IS_TRUE(rc);
+
+    wait = client.nextDeadline();
+    IS_TRUE(wait > MQTT_RETRY_INTERVAL * 1000UL);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_deadline_reconnect() {
+    IT("reports the next automatic reconnection attempt as the deadline");
+
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    client.setAutoReconnect(true, 4000, 4000);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    // The lost connection is noticed by loop()
+    shimClient.setConnected(false);
+    IS_TRUE(client.nextDeadline() == 0);
+
+    // Which then waits for between half and all of the backoff
+    rc = client.loop();
+    IS_FALSE(rc);
+
+    unsigned long wait = client.nextDeadline();
+    IS_TRUE(wait <= 4000);
+    IS_TRUE(wait > 0);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_deadline_sleep() {
+    IT("sends the keepalive ping once the reported deadline has passed (takes 15 seconds)");
+
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    // The test clock counts whole seconds, so it can be up to one behind
+    usleep((client.nextDeadline() + 1000) * 1000);
+    IS_TRUE(client.nextDeadline() == 0);
+
+    byte pingreq[] = { 0xC0,0x0 };
+    shimClient.expect(pingreq,2);
+
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(shimClient.writes() == 2);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
 int main()
 {
     SUITE("Keep-alive");
@@ -180,6 +309,10 @@ int main()
     test_keepalive_pings_with_inbound_qos0();
     test_keepalive_no_pings_inbound_qos1();
     test_keepalive_disconnects_hung();
+    test_deadline_idle();
+    test_deadline_inflight();
+    test_deadline_reconnect();
+    test_deadline_sleep();
 
     FINISH
 }
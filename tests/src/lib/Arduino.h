@@ -16,10 +16,15 @@ extern "C"{
     extern void setup( void ) ;
     extern void loop( void ) ;
     uint32_t millis( void );
+    uint32_t micros( void );
 }
 
+long random( long howbig );
+
 #define PROGMEM
 #define pgm_read_byte_near(x) *(x)
+#define memcpy_P memcpy
+#define memcmp_P memcmp
 
 #define yield(x) {}
 
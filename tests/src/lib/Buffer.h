@@ -14,6 +14,8 @@ public:
     Buffer(uint8_t* buf, size_t size);
     
     virtual bool available();
+    // The number of bytes not yet taken with next()
+    virtual size_t remaining();
     virtual uint8_t next();
     virtual void reset();
     
@@ -8,6 +8,14 @@ extern "C" {
     uint32_t millis(void) {
        return time(0)*1000;
     }
+
+    uint32_t micros(void) {
+       return clock();
+    }
+}
+
+long random(long howbig) {
+    return howbig ? random() % howbig : 0;
 }
 
 ShimClient::ShimClient() {
@@ -18,6 +26,8 @@ ShimClient::ShimClient() {
     this->_error = false;
     this->expectAnything = true;
     this->_received = 0;
+    this->_writes = 0;
+    this->_reads = 0;
     this->_expectedPort = 0;
 }
 
@@ -56,6 +66,7 @@ int ShimClient::connect(const char *host, uint16_t port)  {
 }
 size_t ShimClient::write(uint8_t b)  {
     this->_received += 1;
+    this->_writes += 1;
     TRACE(std::hex << (unsigned int)b);
     if (!this->expectAnything) {
         if (this->expectBuffer->available()) {
@@ -73,6 +84,7 @@ size_t ShimClient::write(uint8_t b)  {
 }
 size_t ShimClient::write(const uint8_t *buf, size_t size)  {
     this->_received += size;
+    this->_writes += 1;
     TRACE( "[" << std::dec << (unsigned int)(size) << "] ");
     uint16_t i=0;
     for (;i<size;i++) {
@@ -97,10 +109,11 @@ size_t ShimClient::write(const uint8_t *buf, size_t size)  {
     return size;
 }
 int ShimClient::available()  {
-    return this->responseBuffer->available();
+    return this->responseBuffer->remaining();
 }
 int ShimClient::read()  { return this->responseBuffer->next(); }
 int ShimClient::read(uint8_t *buf, size_t size) {
+    this->_reads += 1;
     uint16_t i = 0;
     for (;i<size;i++) {
         buf[i] = this->read();
@@ -142,6 +155,14 @@ uint16_t ShimClient::received() {
     return this->_received;
 }
 
+uint16_t ShimClient::writes() {
+    return this->_writes;
+}
+
+uint16_t ShimClient::reads() {
+    return this->_reads;
+}
+
 void ShimClient::expectConnect(IPAddress ip, uint16_t port) {
     this->_expectedIP = ip;
     this->_expectedPort = port;
@@ -16,6 +16,8 @@ private:
     bool expectAnything;
     bool _error;
     uint16_t _received;
+    uint16_t _writes;
+    uint16_t _reads;
     IPAddress _expectedIP;
     uint16_t _expectedPort;
     const char* _expectedHost;
@@ -42,6 +44,9 @@ public:
   virtual void expectConnect(const char *host, uint16_t port);
   
   virtual uint16_t received();
+  virtual uint16_t writes();
+  // The number of calls to read(buf, size)
+  virtual uint16_t reads();
   virtual bool error();
   
   virtual void setAllowConnect(bool b);
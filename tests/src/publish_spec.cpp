@@ -7,6 +7,22 @@
 
 byte server[] = { 172, 16, 0, 2 };
 
+uint16_t completedId = 0;
+int completedCount = 0;
+bool completedDelivered = false;
+
+void publish_callback(uint16_t msgId, boolean delivered) {
+    completedId = msgId;
+    completedCount++;
+    completedDelivered = delivered;
+}
+
+void reset_publish_callback() {
+    completedId = 0;
+    completedCount = 0;
+    completedDelivered = false;
+}
+
 void callback(char* topic, byte* payload, unsigned int length) {
   // handle message arrived
 }
@@ -126,7 +142,7 @@ int test_publish_not_connected() {
 }
 
 int test_publish_too_long() {
-    IT("publish fails when topic/payload are too long");
+    IT("publish fails when the topic is too long");
     ShimClient shimClient;
     shimClient.setAllowConnect(true);
 
@@ -137,8 +153,8 @@ int test_publish_too_long() {
     int rc = client.connect((char*)"client_test1");
     IS_TRUE(rc);
 
-    //                                         0        1         2         3         4         5         6         7         8         9         0         1         2
-    rc = client.publish((char*)"topic",(char*)"123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890");
+    //                          0        1         2         3         4         5         6         7         8         9         0         1         2         3
+    rc = client.publish((char*)"1234567890123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890",(char*)"payload");
     IS_FALSE(rc);
 
     IS_FALSE(shimClient.error());
@@ -146,6 +162,136 @@ int test_publish_too_long() {
     END_IT
 }
 
+int test_publish_larger_than_buffer() {
+    IT("publishes a payload larger than the buffer");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    // 3 byte fixed header, 7 byte topic, 190 byte payload
+    byte payload[190];
+    memset(payload,'A',190);
+    byte publish[] = {0x30,0xc5,0x01,0x0,0x5,0x74,0x6f,0x70,0x69,0x63};
+    shimClient.expect(publish,10);
+    shimClient.expect(payload,190);
+
+    rc = client.publish((char*)"topic",payload,190);
+    IS_TRUE(rc);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+class VectoredShimClient : public ShimClient, public VectoredClient {
+public:
+    int writevCalls = 0;
+    const uint8_t* lastTopic = nullptr;
+    const uint8_t* lastPayload = nullptr;
+
+    virtual size_t writev(const MQTTIOVec* iov, uint8_t count) {
+        size_t rc = 0;
+        writevCalls++;
+        for (uint8_t i = 0; i < count; i++) {
+            rc += write(iov[i].base, iov[i].length);
+        }
+        lastTopic = iov[count-2].base;
+        lastPayload = iov[count-1].base;
+        return rc;
+    }
+};
+
+int test_publish_vectored() {
+    IT("publishes the payload in place through a vectored client");
+    VectoredShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(shimClient);
+    client.setServer(server, 1883).setClient(shimClient, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte payload[] = { 0x01,0x02,0x03,0x0,0x05 };
+    byte publish[] = {0x30,0xc,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x1,0x2,0x3,0x0,0x5};
+    shimClient.expect(publish,14);
+
+    rc = client.publish((char*)"topic",payload,5);
+    IS_TRUE(rc);
+    IS_TRUE(shimClient.writevCalls == 1);
+    IS_TRUE(shimClient.lastPayload == payload);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_publish_topic_handle() {
+    IT("publishes to a prepared topic");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    static constexpr TopicHandle topic("topic");
+    static_assert(topic.length == 5, "topic length is worked out at compile time");
+
+    byte publish[] = {0x31,0xe,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    shimClient.expect(publish,16);
+
+    uint16_t writes = shimClient.writes();
+    rc = client.publish(topic,(char*)"payload",true);
+    IS_TRUE(rc);
+    IS_TRUE(shimClient.writes() - writes == 1);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_publish_topic_handle_vectored() {
+    IT("publishes a prepared topic in place through a vectored client");
+    VectoredShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(shimClient);
+    client.setServer(server, 1883).setClient(shimClient, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    const char* name = "topic";
+    TopicHandle topic(name);
+    byte payload[] = { 0x01,0x02,0x03,0x0,0x05 };
+    byte publish[] = {0x30,0xc,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x1,0x2,0x3,0x0,0x5};
+    shimClient.expect(publish,14);
+
+    rc = client.publish(topic,payload,5);
+    IS_TRUE(rc);
+    IS_TRUE(shimClient.writevCalls == 1);
+    IS_TRUE(shimClient.lastTopic == (const uint8_t*)name);
+    IS_TRUE(shimClient.lastPayload == payload);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
 int test_publish_P() {
     IT("publishes using PROGMEM");
     ShimClient shimClient;
@@ -164,16 +310,577 @@ int test_publish_P() {
     byte publish[] = {0x31,0xc,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x1,0x2,0x3,0x0,0x5};
     shimClient.expect(publish,14);
 
+    uint16_t writes = shimClient.writes();
     rc = client.publish_P((char*)"topic",payload,length,true);
     IS_TRUE(rc);
+    IS_TRUE(shimClient.writes() - writes == 1);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+
+
+
+int test_publish_larger_buffer() {
+    IT("publishes a message larger than the default buffer after setBufferSize");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    IS_TRUE(client.setBufferSize(MQTT_MAX_PACKET_SIZE*2));
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    // 3 byte fixed header, 7 byte topic, 190 byte payload
+    byte payload[190];
+    memset(payload,'A',190);
+    byte publish[] = {0x30,0xc5,0x01,0x0,0x5,0x74,0x6f,0x70,0x69,0x63};
+    shimClient.expect(publish,10);
+    shimClient.expect(payload,190);
+
+    rc = client.publish((char*)"topic",payload,190);
+    IS_TRUE(rc);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_publish_too_long_for_buffer() {
+    IT("publish fails when topic/payload are too long for a smaller buffer");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    IS_FALSE(client.setBufferSize(MQTT_MAX_HEADER_SIZE+1));
+    IS_TRUE(client.setBufferSize(32));
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    rc = client.publish((char*)"1234567890123456789012345",(char*)"payload");
+    IS_TRUE(rc);
+
+    rc = client.publish((char*)"12345678901234567890123456",(char*)"payload");
+    IS_FALSE(rc);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_publish_P_chunked() {
+    IT("publishes a large PROGMEM payload in buffer-sized writes");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    IS_TRUE(client.setBufferSize(32));
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    // 2 byte fixed header, 7 byte topic, 100 byte payload
+    byte payload[100];
+    for (int i = 0; i < 100; i++) {
+        payload[i] = i;
+    }
+    byte publish[] = {0x30,0x6b,0x0,0x5,0x74,0x6f,0x70,0x69,0x63};
+    shimClient.expect(publish,9);
+    shimClient.expect(payload,100);
+
+    uint16_t writes = shimClient.writes();
+    rc = client.publish_P((char*)"topic",payload,100,false);
+    IS_TRUE(rc);
+
+    // 9+20, 32, 32 and 16 bytes
+    IS_TRUE(shimClient.writes() - writes == 4);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_publish_streamed() {
+    IT("publishes a streamed payload in a single write");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte publish[] = {0x30,0xe,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    shimClient.expect(publish,16);
+
+    uint16_t writes = shimClient.writes();
+    rc = client.beginPublish((char*)"topic",7,false);
+    IS_TRUE(rc);
+    const char* payload = "payload";
+    for (int i = 0; i < 7; i++) {
+        IS_TRUE(client.write(payload[i]) == 1);
+    }
+    IS_TRUE(shimClient.writes() == writes);
+
+    rc = client.endPublish();
+    IS_TRUE(rc);
+    IS_TRUE(shimClient.writes() - writes == 1);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_publish_streamed_large() {
+    IT("publishes a streamed payload larger than the buffer in buffer-sized writes");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    IS_TRUE(client.setBufferSize(32));
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    // 2 byte fixed header, 7 byte topic, 100 byte payload
+    byte payload[100];
+    for (int i = 0; i < 100; i++) {
+        payload[i] = i;
+    }
+    byte publish[] = {0x30,0x6b,0x0,0x5,0x74,0x6f,0x70,0x69,0x63};
+    shimClient.expect(publish,9);
+    shimClient.expect(payload,100);
+
+    uint16_t writes = shimClient.writes();
+    rc = client.beginPublish((char*)"topic",100,false);
+    IS_TRUE(rc);
+    for (int i = 0; i < 100; i += 10) {
+        IS_TRUE(client.write(payload+i,10) == 10);
+    }
+    rc = client.endPublish();
+    IS_TRUE(rc);
+
+    // 9+20, 30, 30 and 20 bytes
+    IS_TRUE(shimClient.writes() - writes == 4);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_publish_batch() {
+    IT("collects batched packets into a single write");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte publish[] = {0x30,0xe,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    byte subscribe[] = { 0x82,0xa,0x0,0x2,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x0 };
+    shimClient.expect(publish,16);
+    shimClient.expect(publish,16);
+    shimClient.expect(subscribe,12);
+
+    uint16_t writes = shimClient.writes();
+    client.beginBatch();
+    IS_TRUE(client.publish((char*)"topic",(char*)"payload"));
+    IS_TRUE(client.publish((char*)"topic",(char*)"payload"));
+    IS_TRUE(client.subscribe((char*)"topic"));
+    IS_TRUE(shimClient.writes() == writes);
+
+    rc = client.flushBatch();
+    IS_TRUE(rc);
+    IS_TRUE(shimClient.writes() - writes == 1);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_publish_batch_overflow() {
+    IT("sends the batch when the buffer fills up");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    IS_TRUE(client.setBufferSize(40));
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte publish[] = {0x30,0xe,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    shimClient.expect(publish,16);
+    shimClient.expect(publish,16);
+    shimClient.expect(publish,16);
+
+    uint16_t writes = shimClient.writes();
+    client.beginBatch();
+    IS_TRUE(client.publish((char*)"topic",(char*)"payload"));
+    IS_TRUE(client.publish((char*)"topic",(char*)"payload"));
+    IS_TRUE(shimClient.writes() == writes);
+
+    // Does not fit behind the first two
+    IS_TRUE(client.publish((char*)"topic",(char*)"payload"));
+    IS_TRUE(shimClient.writes() - writes == 1);
+
+    rc = client.flushBatch();
+    IS_TRUE(rc);
+    IS_TRUE(shimClient.writes() - writes == 2);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_publish_batch_keeps_buffer() {
+    IT("keeps the buffer while a batch is staged in it");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte publish[] = {0x30,0xe,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    shimClient.expect(publish,16);
+
+    client.beginBatch();
+    IS_TRUE(client.publish((char*)"topic",(char*)"payload"));
+    IS_FALSE(client.setBufferSize(4000));
+    IS_TRUE(client.getBufferSize() == MQTT_MAX_PACKET_SIZE);
+
+    rc = client.flushBatch();
+    IS_TRUE(rc);
+
+    // Once it has been sent the buffer can change
+    IS_TRUE(client.setBufferSize(4000));
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_publish_batch_streamed() {
+    IT("batches streamed and program memory publishes");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte publish[] = {0x30,0xe,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    shimClient.expect(publish,16);
+    shimClient.expect(publish,16);
+
+    uint16_t writes = shimClient.writes();
+    client.beginBatch();
+    IS_TRUE(client.publish_P((char*)"topic",(const uint8_t*)"payload",7,false));
+    IS_TRUE(client.beginPublish((char*)"topic",7,false));
+    IS_TRUE(client.write((const uint8_t*)"payload",7) == 7);
+    IS_TRUE(client.endPublish());
+    IS_TRUE(shimClient.writes() == writes);
+
+    rc = client.flushBatch();
+    IS_TRUE(rc);
+    IS_TRUE(shimClient.writes() - writes == 1);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_publish_framed() {
+    IT("publishes a framed packet as it is, batched with others");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    byte publish[] = {0x30,0xe,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    IS_FALSE(client.publishFramed(publish,16));
+
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    shimClient.expect(publish,16);
+    shimClient.expect(publish,16);
+    shimClient.expect(publish,16);
+
+    uint16_t writes = shimClient.writes();
+    IS_TRUE(client.publishFramed(publish,16));
+    IS_TRUE(shimClient.writes() - writes == 1);
+
+    client.beginBatch();
+    IS_TRUE(client.publishFramed(publish,16));
+    IS_TRUE(client.publishFramed(publish,16));
+    IS_TRUE(shimClient.writes() - writes == 1);
+    rc = client.flushBatch();
+    IS_TRUE(rc);
+    IS_TRUE(shimClient.writes() - writes == 2);
+
+    // Only a QoS 0 PUBLISH, which needs no message id, is accepted
+    byte qos1[] = {0x32,0x10,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x0,0x1,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    byte subscribe[] = { 0x82,0xa,0x0,0x2,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x0 };
+    IS_FALSE(client.publishFramed(qos1,18));
+    IS_FALSE(client.publishFramed(subscribe,12));
+    IS_TRUE(shimClient.writes() - writes == 2);
 
     IS_FALSE(shimClient.error());
 
     END_IT
 }
 
+int test_publish_qos1() {
+    IT("publishes with qos 1 and completes on puback");
+    reset_publish_callback();
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    client.setPublishCallback(publish_callback);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte publish[] = {0x32,0x10,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x0,0x2,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    shimClient.expect(publish,18);
 
+    rc = client.publish((char*)"topic",(char*)"payload",1,false);
+    IS_TRUE(rc);
+    IS_TRUE(client.getLastMessageId() == 2);
+    IS_TRUE(client.getInflightCount() == 1);
 
+    byte puback[] = { 0x40, 0x02, 0x00, 0x02 };
+    shimClient.respond(puback,4);
+
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(completedCount == 1);
+    IS_TRUE(completedId == 2);
+    IS_TRUE(completedDelivered);
+    IS_TRUE(client.getInflightCount() == 0);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_publish_qos1_window() {
+    IT("keeps a window of qos 1 messages in flight");
+    reset_publish_callback();
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    client.setPublishCallback(publish_callback);
+    IS_TRUE(client.setInflightWindow(2));
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte publish2[] = {0x32,0x10,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x0,0x2,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    byte publish3[] = {0x32,0x10,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x0,0x3,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    byte publish5[] = {0x32,0x10,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x0,0x5,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    shimClient.expect(publish2,18);
+    shimClient.expect(publish3,18);
+    shimClient.expect(publish5,18);
+
+    IS_TRUE(client.publish((char*)"topic",(char*)"payload",1,false));
+    IS_TRUE(client.publish((char*)"topic",(char*)"payload",1,false));
+    IS_FALSE(client.publish((char*)"topic",(char*)"payload",1,false));
+    IS_TRUE(client.getInflightCount() == 2);
+    IS_FALSE(client.setInflightWindow(1));
+
+    // Acknowledged out of order
+    byte puback[] = { 0x40, 0x02, 0x00, 0x03 };
+    shimClient.respond(puback,4);
+
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(completedId == 3);
+    IS_TRUE(client.getInflightCount() == 1);
+
+    // Id 4 would share a slot with id 2, which is still waiting
+    IS_TRUE(client.publish((char*)"topic",(char*)"payload",1,false));
+    IS_TRUE(client.getLastMessageId() == 5);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_publish_qos1_caller_store() {
+    IT("keeps qos 1 messages in a store handed to the client");
+    reset_publish_callback();
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    uint8_t store[2 * 32];
+    memset(store, 0, sizeof(store));
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    IS_TRUE(client.setBufferSize(32));
+    IS_TRUE(client.setInflightWindow(2, store));
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte publish[] = {0x32,0x10,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x0,0x2,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    shimClient.expect(publish,18);
+
+    rc = client.publish((char*)"topic",(char*)"payload",1,false);
+    IS_TRUE(rc);
+
+    // Id 2 is kept in slot 0
+    IS_TRUE(memcmp(store, publish, 18) == 0);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_publish_qos1_caller_store_default_buffer() {
+    IT("keeps a store handed to the client before the buffers are allocated");
+    reset_publish_callback();
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    uint8_t store[2 * MQTT_MAX_PACKET_SIZE];
+    memset(store, 0, sizeof(store));
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    IS_TRUE(client.setInflightWindow(2, store));
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    // The store was sized for the transmit buffer, which cannot change size now
+    IS_FALSE(client.setBufferSize(64));
+    IS_TRUE(client.setBufferSize(256, MQTT_MAX_PACKET_SIZE));
+
+    byte publish[] = {0x32,0x10,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x0,0x2,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    shimClient.expect(publish,18);
+
+    rc = client.publish((char*)"topic",(char*)"payload",1,false);
+    IS_TRUE(rc);
+
+    // Id 2 is kept in slot 0
+    IS_TRUE(memcmp(store, publish, 18) == 0);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_publish_qos1_resend() {
+    IT("sends qos 1 messages again when the session is resumed");
+    reset_publish_callback();
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connect[] = {0x10,0x18,0x0,0x4,0x4d,0x51,0x54,0x54,0x4,0x0,0x0,0xf,0x0,0xc,0x63,0x6c,0x69,0x65,0x6e,0x74,0x5f,0x74,0x65,0x73,0x74,0x31};
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    byte publish[] = {0x32,0x10,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x0,0x2,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    byte resumed[] = { 0x20, 0x02, 0x01, 0x00 };
+    byte duplicate[] = {0x3a,0x10,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x0,0x2,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    shimClient.expect(connect,26);
+    shimClient.respond(connack,4);
+    shimClient.expect(publish,18);
+    shimClient.expect(connect,26);
+    shimClient.expect(duplicate,18);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    client.setPublishCallback(publish_callback);
+    int rc = client.connect((char*)"client_test1",0,0,0,0,0,0,0);
+    IS_TRUE(rc);
+
+    rc = client.publish((char*)"topic",(char*)"payload",1,false);
+    IS_TRUE(rc);
+
+    shimClient.setConnected(false);
+    IS_FALSE(client.connected());
+
+    shimClient.respond(resumed,4);
+    rc = client.connect((char*)"client_test1",0,0,0,0,0,0,0);
+    IS_TRUE(rc);
+    IS_TRUE(completedCount == 0);
+    IS_TRUE(client.getInflightCount() == 1);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_publish_qos1_session_lost() {
+    IT("reports qos 1 messages as undelivered when the session is lost");
+    reset_publish_callback();
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    client.setPublishCallback(publish_callback);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    rc = client.publish((char*)"topic",(char*)"payload",1,false);
+    IS_TRUE(rc);
+
+    shimClient.setConnected(false);
+    IS_FALSE(client.connected());
+
+    shimClient.respond(connack,4);
+    rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+    IS_TRUE(completedCount == 1);
+    IS_TRUE(completedId == 2);
+    IS_FALSE(completedDelivered);
+    IS_TRUE(client.getInflightCount() == 0);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
 
 int main()
 {
@@ -185,6 +892,26 @@ int main()
     test_publish_not_connected();
     test_publish_too_long();
     test_publish_P();
+    test_publish_P_chunked();
+    test_publish_larger_buffer();
+    test_publish_too_long_for_buffer();
+    test_publish_larger_than_buffer();
+    test_publish_vectored();
+    test_publish_topic_handle();
+    test_publish_topic_handle_vectored();
+    test_publish_streamed();
+    test_publish_streamed_large();
+    test_publish_batch();
+    test_publish_batch_overflow();
+    test_publish_batch_streamed();
+    test_publish_batch_keeps_buffer();
+    test_publish_framed();
+    test_publish_qos1();
+    test_publish_qos1_window();
+    test_publish_qos1_caller_store();
+    test_publish_qos1_caller_store_default_buffer();
+    test_publish_qos1_resend();
+    test_publish_qos1_session_lost();
 
     FINISH
 }
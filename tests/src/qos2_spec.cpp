@@ -0,0 +1,257 @@
+#include "PubSubClient.h"
+#include "ShimClient.h"
+#include "Buffer.h"
+#include "BDDTest.h"
+#include "trace.h"
+
+
+byte server[] = { 172, 16, 0, 2 };
+
+int callbackCount = 0;
+char lastTopic[1024];
+char lastPayload[1024];
+unsigned int lastLength;
+
+uint16_t completedId = 0;
+int completedCount = 0;
+
+void reset_callback() {
+    callbackCount = 0;
+    lastTopic[0] = '\0';
+    lastPayload[0] = '\0';
+    lastLength = 0;
+    completedId = 0;
+    completedCount = 0;
+}
+
+void callback(char* topic, byte* payload, unsigned int length) {
+    callbackCount++;
+    strcpy(lastTopic,topic);
+    memcpy(lastPayload,payload,length);
+    lastLength = length;
+}
+
+void publish_callback(uint16_t msgId, boolean delivered) {
+    if (delivered) {
+        completedId = msgId;
+        completedCount++;
+    }
+}
+
+int test_qos2_publish() {
+    IT("publishes with qos 2 through the four-way handshake");
+    reset_callback();
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    client.setPublishCallback(publish_callback);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte publish[] = {0x34,0x10,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x0,0x2,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    byte pubrel[] = { 0x62, 0x02, 0x00, 0x02 };
+    shimClient.expect(publish,18);
+    shimClient.expect(pubrel,4);
+
+    rc = client.publish((char*)"topic",(char*)"payload",2,false);
+    IS_TRUE(rc);
+    IS_TRUE(client.getLastMessageId() == 2);
+
+    byte pubrec[] = { 0x50, 0x02, 0x00, 0x02 };
+    shimClient.respond(pubrec,4);
+
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(completedCount == 0);
+    IS_TRUE(client.getInflightCount() == 1);
+
+    byte pubcomp[] = { 0x70, 0x02, 0x00, 0x02 };
+    shimClient.respond(pubcomp,4);
+
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(completedCount == 1);
+    IS_TRUE(completedId == 2);
+    IS_TRUE(client.getInflightCount() == 0);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_qos2_publish_ignores_out_of_order() {
+    IT("only completes a qos 2 publish once it has been received and released");
+    reset_callback();
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    client.setPublishCallback(publish_callback);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    rc = client.publish((char*)"topic",(char*)"payload",2,false);
+    IS_TRUE(rc);
+
+    // Neither a PUBACK nor an early PUBCOMP completes it
+    byte puback[] = { 0x40, 0x02, 0x00, 0x02 };
+    shimClient.respond(puback,4);
+    rc = client.loop();
+    IS_TRUE(rc);
+
+    byte pubcomp[] = { 0x70, 0x02, 0x00, 0x02 };
+    shimClient.respond(pubcomp,4);
+    rc = client.loop();
+    IS_TRUE(rc);
+
+    IS_TRUE(completedCount == 0);
+    IS_TRUE(client.getInflightCount() == 1);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_qos2_receive() {
+    IT("receives a qos 2 message through the four-way handshake");
+    reset_callback();
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte pubrec[] = { 0x50, 0x02, 0x12, 0x34 };
+    byte pubcomp[] = { 0x70, 0x02, 0x12, 0x34 };
+    shimClient.expect(pubrec,4);
+    shimClient.expect(pubcomp,4);
+
+    byte publish[] = {0x34,0x10,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x12,0x34,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    shimClient.respond(publish,18);
+
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(callbackCount == 1);
+    IS_TRUE(strcmp(lastTopic,"topic")==0);
+    IS_TRUE(memcmp(lastPayload,"payload",7)==0);
+    IS_TRUE(lastLength == 7);
+
+    byte pubrel[] = { 0x62, 0x02, 0x12, 0x34 };
+    shimClient.respond(pubrel,4);
+
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(callbackCount == 1);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_qos2_receive_duplicate() {
+    IT("delivers a qos 2 message once when it is sent again before release");
+    reset_callback();
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte pubrec[] = { 0x50, 0x02, 0x12, 0x34 };
+    byte pubcomp[] = { 0x70, 0x02, 0x12, 0x34 };
+    shimClient.expect(pubrec,4);
+    shimClient.expect(pubrec,4);
+    shimClient.expect(pubcomp,4);
+    shimClient.expect(pubrec,4);
+
+    byte publish[] = {0x34,0x10,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x12,0x34,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    byte duplicate[] = {0x3c,0x10,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x12,0x34,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    byte pubrel[] = { 0x62, 0x02, 0x12, 0x34 };
+
+    shimClient.respond(publish,18);
+    rc = client.loop();
+    IS_TRUE(rc);
+
+    shimClient.respond(duplicate,18);
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(callbackCount == 1);
+
+    shimClient.respond(pubrel,4);
+    rc = client.loop();
+    IS_TRUE(rc);
+
+    // Once released the id is free to be used for a new message
+    shimClient.respond(publish,18);
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(callbackCount == 2);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_qos2_receive_full() {
+    IT("leaves a qos 2 message unacknowledged while no more can be held");
+    reset_callback();
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte publish[] = {0x34,0x10,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x0,0x1,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+
+    for (int i = 1; i <= MQTT_MAX_INBOUND; i++) {
+        byte pubrec[] = { 0x50, 0x02, 0x00, (byte)i };
+        publish[10] = i;
+        shimClient.expect(pubrec,4);
+        shimClient.respond(publish,18);
+        rc = client.loop();
+        IS_TRUE(rc);
+    }
+    IS_TRUE(callbackCount == MQTT_MAX_INBOUND);
+
+    publish[10] = MQTT_MAX_INBOUND + 1;
+    shimClient.respond(publish,18);
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(callbackCount == MQTT_MAX_INBOUND);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int main()
+{
+    SUITE("QoS 2");
+
+    test_qos2_publish();
+    test_qos2_publish_ignores_out_of_order();
+    test_qos2_receive();
+    test_qos2_receive_duplicate();
+    test_qos2_receive_full();
+
+    FINISH
+}
@@ -12,8 +12,13 @@ char lastTopic[1024];
 char lastPayload[1024];
 unsigned int lastLength;
 
+uint8_t lastQos;
+bool lastRetained;
+
 void reset_callback() {
     callback_called = false;
+    lastQos = 0xFF;
+    lastRetained = false;
     lastTopic[0] = '\0';
     lastPayload[0] = '\0';
     lastLength = 0;
@@ -26,6 +31,16 @@ void callback(char* topic, byte* payload, unsigned int length) {
     lastLength = length;
 }
 
+void message_callback(const char* topic, uint16_t topicLength, const byte* payload, unsigned int length, uint8_t qos, boolean retained) {
+    callback_called = true;
+    memcpy(lastTopic,topic,topicLength);
+    lastTopic[topicLength] = '\0';
+    memcpy(lastPayload,payload,length);
+    lastLength = length;
+    lastQos = qos;
+    lastRetained = retained;
+}
+
 int test_receive_callback() {
     IT("receives a callback message");
     reset_callback();
@@ -107,7 +122,7 @@ int test_receive_max_sized_message() {
 
     int length = MQTT_MAX_PACKET_SIZE;
     byte publish[] = {0x30,length-2,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
-    byte bigPublish[length];
+    byte bigPublish[length+1];
     memset(bigPublish,'A',length);
     bigPublish[length] = 'B';
     memcpy(bigPublish,publish,16);
@@ -143,7 +158,7 @@ int test_receive_oversized_message() {
 
     int length = MQTT_MAX_PACKET_SIZE+1;
     byte publish[] = {0x30,length-2,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
-    byte bigPublish[length];
+    byte bigPublish[length+1];
     memset(bigPublish,'A',length);
     bigPublish[length] = 'B';
     memcpy(bigPublish,publish,16);
@@ -208,7 +223,7 @@ int test_receive_oversized_stream_message() {
     int length = MQTT_MAX_PACKET_SIZE+1;
     byte publish[] = {0x30,length-2,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
 
-    byte bigPublish[length];
+    byte bigPublish[length+1];
     memset(bigPublish,'A',length);
     bigPublish[length] = 'B';
     memcpy(bigPublish,publish,16);
@@ -230,6 +245,46 @@ int test_receive_oversized_stream_message() {
     END_IT
 }
 
+int test_drop_truncated_publish() {
+    IT("drops a publish too short for its topic or message id");
+    reset_callback();
+
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    uint16_t writes = shimClient.writes();
+
+    // A topic length far past the end of the packet
+    byte longTopic[] = {0x32,0x04,0xff,0xf0,0x00,0x01};
+    shimClient.respond(longTopic,6);
+    IS_TRUE(client.loop());
+
+    // No room for the topic length
+    byte noTopic[] = {0x30,0x00};
+    shimClient.respond(noTopic,2);
+    IS_TRUE(client.loop());
+
+    // The topic fits but the message id does not
+    byte noMsgId[] = {0x32,0x07,0x0,0x5,0x74,0x6f,0x70,0x69,0x63};
+    shimClient.respond(noMsgId,9);
+    IS_TRUE(client.loop());
+
+    IS_FALSE(callback_called);
+    IS_TRUE(shimClient.writes() == writes);
+    IS_TRUE(client.connected());
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
 int test_receive_qos1() {
     IT("receives a qos1 message");
     reset_callback();
@@ -250,6 +305,122 @@ int test_receive_qos1() {
     byte puback[] = {0x40,0x2,0x12,0x34};
     shimClient.expect(puback,4);
 
+    // The whole body is taken in one read
+    uint16_t reads = shimClient.reads();
+    rc = client.loop();
+
+    IS_TRUE(rc);
+    IS_TRUE(shimClient.reads() - reads == 1);
+
+    IS_TRUE(callback_called);
+    IS_TRUE(strcmp(lastTopic,"topic")==0);
+    IS_TRUE(memcmp(lastPayload,"payload",7)==0);
+    IS_TRUE(lastLength == 7);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_receive_partial_message() {
+    IT("receives a message delivered across several loops");
+    reset_callback();
+
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte publish[] = {0x32,0x10,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x12,0x34,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    byte puback[] = {0x40,0x2,0x12,0x34};
+    shimClient.expect(puback,4);
+
+    // Split inside the remaining length, the topic, the message id and the payload
+    int splits[] = { 1, 3, 7, 10, 14, 18 };
+    int sent = 0;
+    for (int i = 0; i < 6; i++) {
+        IS_FALSE(callback_called);
+        shimClient.respond(publish+sent,splits[i]-sent);
+        sent = splits[i];
+        rc = client.loop();
+        IS_TRUE(rc);
+    }
+
+    IS_TRUE(callback_called);
+    IS_TRUE(strcmp(lastTopic,"topic")==0);
+    IS_TRUE(memcmp(lastPayload,"payload",7)==0);
+    IS_TRUE(lastLength == 7);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_receive_partial_stream() {
+    IT("receives a streamed message delivered across several loops");
+    reset_callback();
+
+    Stream stream;
+    stream.expect((uint8_t*)"payload",7);
+
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient, stream);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte publish[] = {0x30,0xe,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    shimClient.respond(publish,12);
+
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_FALSE(callback_called);
+    IS_TRUE(stream.length() == 3);
+
+    shimClient.respond(publish+12,4);
+
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(callback_called);
+    IS_TRUE(strcmp(lastTopic,"topic")==0);
+    IS_TRUE(lastLength == 7);
+
+    IS_FALSE(stream.error());
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_receive_message_callback() {
+    IT("receives a message callback without copying the topic");
+    reset_callback();
+
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, shimClient);
+    client.setMessageCallback(message_callback);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte publish[] = {0x33,0x10,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x12,0x34,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    shimClient.respond(publish,18);
+
+    byte puback[] = {0x40,0x2,0x12,0x34};
+    shimClient.expect(puback,4);
+
     rc = client.loop();
 
     IS_TRUE(rc);
@@ -258,6 +429,124 @@ int test_receive_qos1() {
     IS_TRUE(strcmp(lastTopic,"topic")==0);
     IS_TRUE(memcmp(lastPayload,"payload",7)==0);
     IS_TRUE(lastLength == 7);
+    IS_TRUE(lastQos == 1);
+    IS_TRUE(lastRetained);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_receive_larger_buffer() {
+    IT("receives a message larger than the default buffer after setBufferSize");
+    reset_callback();
+
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    IS_TRUE(client.setBufferSize(MQTT_MAX_PACKET_SIZE*2));
+    IS_TRUE(client.getBufferSize() == MQTT_MAX_PACKET_SIZE*2);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    // 3 byte fixed header, 7 byte topic, 190 byte payload
+    int length = 200;
+    byte publish[] = {0x30,0xc5,0x01,0x0,0x5,0x74,0x6f,0x70,0x69,0x63};
+    byte bigPublish[length];
+    memset(bigPublish,'A',length);
+    memcpy(bigPublish,publish,10);
+    shimClient.respond(bigPublish,length);
+
+    rc = client.loop();
+
+    IS_TRUE(rc);
+
+    IS_TRUE(callback_called);
+    IS_TRUE(strcmp(lastTopic,"topic")==0);
+    IS_TRUE(lastLength == 190);
+    IS_TRUE(memcmp(lastPayload,bigPublish+10,lastLength)==0);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_receive_caller_buffer() {
+    IT("receives into a caller-provided buffer");
+    reset_callback();
+
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    byte rxBuffer[32];
+    byte txBuffer[32];
+    PubSubClient client(shimClient, rxBuffer, txBuffer, 32);
+    client.setServer(server, 1883).setCallback(callback);
+    IS_TRUE(client.getBufferSize() == 32);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte publish[] = {0x30,0xe,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    shimClient.respond(publish,16);
+
+    rc = client.loop();
+
+    IS_TRUE(rc);
+
+    IS_TRUE(callback_called);
+    IS_TRUE(strcmp(lastTopic,"topic")==0);
+    IS_TRUE(memcmp(lastPayload,"payload",7)==0);
+    IS_TRUE(memcmp(rxBuffer+9,"payload",7)==0);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+PubSubClient* forwardingClient;
+bool forwarded;
+
+void forward_callback(char* topic, byte* payload, unsigned int length) {
+    forwarded = forwardingClient->publish("out",payload,length);
+}
+
+int test_receive_publish_in_callback() {
+    IT("publishes the received payload from within the callback");
+    reset_callback();
+
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, forward_callback, shimClient);
+    IS_TRUE(client.setBufferSize(16, 64));
+    IS_TRUE(client.getRxBufferSize() == 16);
+    IS_TRUE(client.getTxBufferSize() == 64);
+    forwardingClient = &client;
+    forwarded = false;
+
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte publish[] = {0x30,0xe,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    shimClient.respond(publish,16);
+
+    byte out[] = {0x30,0xc,0x0,0x3,0x6f,0x75,0x74,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    shimClient.expect(out,14);
+
+    rc = client.loop();
+
+    IS_TRUE(rc);
+    IS_TRUE(forwarded);
 
     IS_FALSE(shimClient.error());
 
@@ -273,7 +562,14 @@ int main()
     test_drop_invalid_remaining_length_message();
     test_receive_oversized_message();
     test_receive_oversized_stream_message();
+    test_drop_truncated_publish();
     test_receive_qos1();
+    test_receive_partial_message();
+    test_receive_partial_stream();
+    test_receive_message_callback();
+    test_receive_larger_buffer();
+    test_receive_caller_buffer();
+    test_receive_publish_in_callback();
 
     FINISH
 }
@@ -0,0 +1,309 @@
+#include "PubSubClient.h"
+#include "ShimClient.h"
+#include "Buffer.h"
+#include "BDDTest.h"
+#include "trace.h"
+
+
+byte server[] = { 172, 16, 0, 2 };
+
+int handlerCalls[4];
+char lastTopic[1024];
+char lastPayload[1024];
+unsigned int lastLength;
+uint8_t lastQos;
+
+void reset_handlers() {
+    memset(handlerCalls,0,sizeof(handlerCalls));
+    lastTopic[0] = '\0';
+    lastPayload[0] = '\0';
+    lastLength = 0;
+    lastQos = 0xFF;
+}
+
+void record(int handler, const char* topic, uint16_t topicLength, const byte* payload, unsigned int length, uint8_t qos) {
+    handlerCalls[handler]++;
+    memcpy(lastTopic,topic,topicLength);
+    lastTopic[topicLength] = '\0';
+    memcpy(lastPayload,payload,length);
+    lastLength = length;
+    lastQos = qos;
+}
+
+void handler0(const char* topic, uint16_t topicLength, const byte* payload, unsigned int length, uint8_t qos, boolean retained) {
+    record(0,topic,topicLength,payload,length,qos);
+}
+
+void handler1(const char* topic, uint16_t topicLength, const byte* payload, unsigned int length, uint8_t qos, boolean retained) {
+    record(1,topic,topicLength,payload,length,qos);
+}
+
+void handler2(const char* topic, uint16_t topicLength, const byte* payload, unsigned int length, uint8_t qos, boolean retained) {
+    record(2,topic,topicLength,payload,length,qos);
+}
+
+void handler3(const char* topic, uint16_t topicLength, const byte* payload, unsigned int length, uint8_t qos, boolean retained) {
+    record(3,topic,topicLength,payload,length,qos);
+}
+
+uint16_t dispatch(TopicRouter& router, const char* topic) {
+    return router.dispatch(topic,strlen(topic),(const byte*)"payload",7,0,false);
+}
+
+int test_router_exact() {
+    IT("dispatches to the handler of an exact filter");
+    reset_handlers();
+    StaticTopicRouter<8> router;
+
+    IS_TRUE(router.add("a/b/c",handler0));
+    IS_TRUE(router.add("a/b",handler1));
+
+    IS_TRUE(dispatch(router,"a/b/c") == 1);
+    IS_TRUE(handlerCalls[0] == 1);
+    IS_TRUE(handlerCalls[1] == 0);
+    IS_TRUE(strcmp(lastTopic,"a/b/c")==0);
+    IS_TRUE(memcmp(lastPayload,"payload",7)==0);
+
+    IS_TRUE(dispatch(router,"a/b") == 1);
+    IS_TRUE(handlerCalls[1] == 1);
+
+    IS_TRUE(dispatch(router,"a/b/d") == 0);
+    IS_TRUE(dispatch(router,"a") == 0);
+    IS_TRUE(dispatch(router,"a/b/c/d") == 0);
+
+    END_IT
+}
+
+int test_router_wildcards() {
+    IT("dispatches to every matching wildcard filter");
+    reset_handlers();
+    StaticTopicRouter<16> router;
+
+    IS_TRUE(router.add("sensor/+/temperature",handler0));
+    IS_TRUE(router.add("sensor/#",handler1));
+    IS_TRUE(router.add("#",handler2));
+    IS_TRUE(router.add("+/+",handler3));
+
+    IS_TRUE(dispatch(router,"sensor/kitchen/temperature") == 3);
+    IS_TRUE(handlerCalls[0] == 1);
+    IS_TRUE(handlerCalls[1] == 1);
+    IS_TRUE(handlerCalls[2] == 1);
+    IS_TRUE(handlerCalls[3] == 0);
+
+    // # also matches the level above it
+    IS_TRUE(dispatch(router,"sensor") == 2);
+    IS_TRUE(handlerCalls[1] == 2);
+    IS_TRUE(handlerCalls[2] == 2);
+
+    IS_TRUE(dispatch(router,"sensor/kitchen") == 3);
+    IS_TRUE(handlerCalls[3] == 1);
+
+    // + matches an empty level
+    IS_TRUE(dispatch(router,"sensor//temperature") == 3);
+    IS_TRUE(handlerCalls[0] == 2);
+
+    END_IT
+}
+
+int test_router_system_topics() {
+    IT("does not match topics starting with $ to wildcards at the first level");
+    reset_handlers();
+    StaticTopicRouter<8> router;
+
+    IS_TRUE(router.add("#",handler0));
+    IS_TRUE(router.add("+/broker",handler1));
+    IS_TRUE(router.add("$SYS/#",handler2));
+    IS_TRUE(router.add("$SYS/+",handler3));
+
+    IS_TRUE(dispatch(router,"$SYS/broker") == 2);
+    IS_TRUE(handlerCalls[0] == 0);
+    IS_TRUE(handlerCalls[1] == 0);
+    IS_TRUE(handlerCalls[2] == 1);
+    IS_TRUE(handlerCalls[3] == 1);
+
+    END_IT
+}
+
+int test_router_invalid() {
+    IT("refuses invalid filters");
+    reset_handlers();
+    StaticTopicRouter<8> router;
+
+    IS_FALSE(router.add("",handler0));
+    IS_FALSE(router.add("a/#/b",handler0));
+    IS_FALSE(router.add("a/b#",handler0));
+    IS_FALSE(router.add("a+/b",handler0));
+    IS_FALSE(router.add("a/+b",handler0));
+    IS_FALSE(router.add("a",nullptr));
+
+    IS_TRUE(dispatch(router,"a/b") == 0);
+
+    END_IT
+}
+
+int test_router_replace_remove() {
+    IT("replaces and removes handlers, reusing the freed nodes");
+    reset_handlers();
+    StaticTopicRouter<3> router;
+
+    IS_TRUE(router.add("a/b/c",handler0));
+    IS_TRUE(router.add("a/b/c",handler1));
+
+    IS_TRUE(dispatch(router,"a/b/c") == 1);
+    IS_TRUE(handlerCalls[0] == 0);
+    IS_TRUE(handlerCalls[1] == 1);
+
+    // The pool is full
+    IS_FALSE(router.add("a/d",handler2));
+    IS_FALSE(router.add("x",handler2));
+    IS_TRUE(dispatch(router,"a/b/c") == 1);
+
+    IS_TRUE(router.remove("a/b/c"));
+    IS_FALSE(router.remove("a/b/c"));
+    IS_FALSE(router.remove("a/b"));
+    IS_TRUE(dispatch(router,"a/b/c") == 0);
+
+    IS_TRUE(router.add("x/y/z",handler2));
+    IS_TRUE(dispatch(router,"x/y/z") == 1);
+    IS_TRUE(handlerCalls[2] == 1);
+
+    END_IT
+}
+
+int test_router_remove_shared() {
+    IT("keeps the levels a removed filter shares with others");
+    reset_handlers();
+    StaticTopicRouter<8> router;
+
+    IS_TRUE(router.add("a/b",handler0));
+    IS_TRUE(router.add("a/b/c",handler1));
+    IS_TRUE(router.add("a/+",handler2));
+
+    IS_TRUE(router.remove("a/b"));
+
+    IS_TRUE(dispatch(router,"a/b") == 1);
+    IS_TRUE(handlerCalls[0] == 0);
+    IS_TRUE(handlerCalls[2] == 1);
+
+    IS_TRUE(dispatch(router,"a/b/c") == 1);
+    IS_TRUE(handlerCalls[1] == 1);
+
+    END_IT
+}
+
+int test_router_many() {
+    IT("dispatches among thousands of filters");
+    reset_handlers();
+    static StaticTopicRouter<4200> router;
+    static char filters[2000][24];
+
+    for (int i = 0; i < 2000; i++) {
+        sprintf(filters[i],"device/%d/state",i);
+        IS_TRUE(router.add(filters[i],(i == 1234) ? handler1 : handler0));
+    }
+    IS_TRUE(router.add("device/+/command",handler2));
+
+    IS_TRUE(dispatch(router,"device/1234/state") == 1);
+    IS_TRUE(handlerCalls[1] == 1);
+    IS_TRUE(handlerCalls[0] == 0);
+
+    IS_TRUE(dispatch(router,"device/1999/command") == 1);
+    IS_TRUE(handlerCalls[2] == 1);
+
+    IS_TRUE(dispatch(router,"device/2000/state") == 0);
+
+    // Every node freed is found again for the next filters
+    for (int i = 0; i < 2000; i++) {
+        IS_TRUE(router.remove(filters[i]));
+    }
+    IS_TRUE(dispatch(router,"device/1234/state") == 0);
+    IS_TRUE(dispatch(router,"device/1234/command") == 1);
+
+    for (int i = 0; i < 2000; i++) {
+        sprintf(filters[i],"site/%d/%d",i % 40,i);
+        IS_TRUE(router.add(filters[i],(i == 1234) ? handler1 : handler0));
+    }
+    IS_TRUE(dispatch(router,"site/34/1234") == 1);
+    IS_TRUE(handlerCalls[1] == 2);
+    IS_TRUE(dispatch(router,"site/33/1234") == 0);
+
+    END_IT
+}
+
+int test_router_same_level() {
+    IT("keeps levels of the same name below different parents apart");
+    reset_handlers();
+    StaticTopicRouter<8> router;
+
+    IS_TRUE(router.add("a/x",handler0));
+    IS_TRUE(router.add("b/x",handler1));
+    IS_TRUE(router.add("x",handler2));
+
+    IS_TRUE(dispatch(router,"b/x") == 1);
+    IS_TRUE(handlerCalls[1] == 1);
+    IS_TRUE(dispatch(router,"x") == 1);
+    IS_TRUE(handlerCalls[2] == 1);
+
+    IS_TRUE(router.remove("a/x"));
+    IS_TRUE(dispatch(router,"a/x") == 0);
+    IS_TRUE(dispatch(router,"b/x") == 1);
+    IS_TRUE(handlerCalls[0] == 0);
+    IS_TRUE(handlerCalls[1] == 2);
+
+    END_IT
+}
+
+int test_router_client() {
+    IT("dispatches received messages through the router");
+    reset_handlers();
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    StaticTopicRouter<4> router;
+    IS_TRUE(router.add("topic",handler0));
+    IS_TRUE(router.add("other",handler1));
+
+    PubSubClient client(server, 1883, shimClient);
+    client.setRouter(router);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte puback[] = { 0x40, 0x02, 0x12, 0x34 };
+    shimClient.expect(puback,4);
+
+    byte publish[] = {0x32,0x10,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x12,0x34,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    shimClient.respond(publish,18);
+
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(handlerCalls[0] == 1);
+    IS_TRUE(handlerCalls[1] == 0);
+    IS_TRUE(strcmp(lastTopic,"topic")==0);
+    IS_TRUE(memcmp(lastPayload,"payload",7)==0);
+    IS_TRUE(lastLength == 7);
+    IS_TRUE(lastQos == 1);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int main()
+{
+    SUITE("Router");
+
+    test_router_exact();
+    test_router_wildcards();
+    test_router_system_topics();
+    test_router_invalid();
+    test_router_replace_remove();
+    test_router_remove_shared();
+    test_router_many();
+    test_router_same_level();
+    test_router_client();
+
+    FINISH
+}
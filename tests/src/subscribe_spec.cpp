@@ -11,6 +11,24 @@ void callback(char* topic, byte* payload, unsigned int length) {
   // handle message arrived
 }
 
+uint16_t ackId = 0;
+int ackCount = 0;
+uint8_t ackResults[8];
+uint16_t ackResultCount = 0;
+
+void reset_subscribe_callback() {
+    ackId = 0;
+    ackCount = 0;
+    ackResultCount = 0;
+}
+
+void subscribe_callback(uint16_t msgId, const uint8_t* results, uint16_t count) {
+    ackId = msgId;
+    ackCount++;
+    ackResultCount = count;
+    memcpy(ackResults, results, count);
+}
+
 int test_subscribe_no_qos() {
     IT("subscribe without qos defaults to 0");
     ShimClient shimClient;
@@ -61,6 +79,530 @@ int test_subscribe_qos_1() {
     END_IT
 }
 
+int test_subscribe_qos_2() {
+    IT("subscribes qos 2");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte subscribe[] = { 0x82,0xa,0x0,0x2,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x2 };
+    shimClient.expect(subscribe,12);
+
+    rc = client.subscribe((char*)"topic",2);
+    IS_TRUE(rc);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_subscribe_inflight() {
+    IT("tracks subscribe and unsubscribe requests until they are acknowledged");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    IS_TRUE(client.setInflightWindow(2));
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    IS_TRUE(client.subscribe((char*)"topic"));
+    IS_TRUE(client.unsubscribe((char*)"topic"));
+    IS_TRUE(client.getInflightCount() == 2);
+
+    // The window is full, so it waits for a free slot
+    uint16_t writes = shimClient.writes();
+    IS_TRUE(client.subscribe((char*)"topic"));
+    IS_TRUE(shimClient.writes() == writes);
+    IS_TRUE(client.getLastMessageId() == 3);
+
+    byte unsuback[] = { 0xb0,0x2,0x0,0x3 };
+    shimClient.respond(unsuback,4);
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(client.getInflightCount() == 2);
+    IS_TRUE(client.getLastMessageId() == 5);
+
+    byte suback[] = { 0x90,0x3,0x0,0x2,0x0 };
+    shimClient.respond(suback,5);
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(client.getInflightCount() == 1);
+
+    byte suback5[] = { 0x90,0x3,0x0,0x5,0x0 };
+    shimClient.respond(suback5,5);
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(client.getInflightCount() == 0);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_subscribe_callback() {
+    IT("reports the granted qos of each subscription when it is acknowledged");
+    reset_subscribe_callback();
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    client.setSubscribeCallback(subscribe_callback);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    IS_TRUE(client.subscribe((char*)"topic",2));
+    IS_TRUE(client.getLastMessageId() == 2);
+    IS_TRUE(client.subscribe((char*)"other",1));
+    IS_TRUE(client.getLastMessageId() == 3);
+
+    // Answered out of order, granting less than asked and refusing the other
+    byte suback3[] = { 0x90,0x3,0x0,0x3,0x80 };
+    shimClient.respond(suback3,5);
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(ackCount == 1);
+    IS_TRUE(ackId == 3);
+    IS_TRUE(ackResultCount == 1);
+    IS_TRUE(ackResults[0] == MQTT_SUBSCRIBE_FAILURE);
+
+    byte suback2[] = { 0x90,0x3,0x0,0x2,0x1 };
+    shimClient.respond(suback2,5);
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(ackCount == 2);
+    IS_TRUE(ackId == 2);
+    IS_TRUE(ackResultCount == 1);
+    IS_TRUE(ackResults[0] == 1);
+
+    IS_TRUE(client.unsubscribe((char*)"topic"));
+    IS_TRUE(client.getLastMessageId() == 4);
+
+    byte unsuback[] = { 0xb0,0x2,0x0,0x4 };
+    shimClient.respond(unsuback,4);
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(ackCount == 3);
+    IS_TRUE(ackId == 4);
+    IS_TRUE(ackResultCount == 0);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_subscribe_callback_session_lost() {
+    IT("reports a subscription as failed when the session is lost");
+    reset_subscribe_callback();
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    client.setSubscribeCallback(subscribe_callback);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    IS_TRUE(client.subscribe((char*)"topic"));
+
+    shimClient.setConnected(false);
+    IS_FALSE(client.connected());
+
+    shimClient.respond(connack,4);
+    rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+    IS_TRUE(ackCount == 1);
+    IS_TRUE(ackId == 2);
+    IS_TRUE(ackResultCount == 1);
+    IS_TRUE(ackResults[0] == MQTT_SUBSCRIBE_FAILURE);
+
+    // It is subscribed to again in the new session
+    IS_TRUE(client.getInflightCount() == 1);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_subscribe_many() {
+    IT("subscribes to several topic filters in one packet");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    const char* topics[] = { "a/1", "a/2", "a/3" };
+    uint8_t qos[] = { 0, 1, 2 };
+    byte subscribe[] = { 0x82,0x14,0x0,0x2,0x0,0x3,0x61,0x2f,0x31,0x0,0x0,0x3,0x61,0x2f,0x32,0x1,0x0,0x3,0x61,0x2f,0x33,0x2 };
+    shimClient.expect(subscribe,22);
+
+    uint16_t writes = shimClient.writes();
+    rc = client.subscribe(topics,qos,3);
+    IS_TRUE(rc);
+    IS_TRUE(shimClient.writes() - writes == 1);
+    IS_TRUE(client.getInflightCount() == 1);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_subscribe_many_split() {
+    IT("splits topic filters across packets that fit the buffer");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    IS_TRUE(client.setBufferSize(32));
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    const char* topics[] = { "a/1", "a/2", "a/3", "a/4", "a/5", "a/6" };
+    byte subscribe1[] = { 0x82,0x1a,0x0,0x2,0x0,0x3,0x61,0x2f,0x31,0x0,0x0,0x3,0x61,0x2f,0x32,0x0,0x0,0x3,0x61,0x2f,0x33,0x0,0x0,0x3,0x61,0x2f,0x34,0x0 };
+    byte subscribe2[] = { 0x82,0xe,0x0,0x3,0x0,0x3,0x61,0x2f,0x35,0x0,0x0,0x3,0x61,0x2f,0x36,0x0 };
+    shimClient.expect(subscribe1,28);
+    shimClient.expect(subscribe2,16);
+
+    uint16_t writes = shimClient.writes();
+    rc = client.subscribe(topics,nullptr,6);
+    IS_TRUE(rc);
+    IS_TRUE(shimClient.writes() - writes == 2);
+    IS_TRUE(client.getInflightCount() == 2);
+    IS_TRUE(client.getLastMessageId() == 3);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_subscribe_many_no_room() {
+    IT("queues the packets that do not fit in the in-flight window");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    IS_TRUE(client.setBufferSize(32));
+    IS_TRUE(client.setInflightWindow(1));
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    const char* topics[] = { "a/1", "a/2", "a/3", "a/4", "a/5", "a/6" };
+    byte subscribe1[] = { 0x82,0x1a,0x0,0x2,0x0,0x3,0x61,0x2f,0x31,0x0,0x0,0x3,0x61,0x2f,0x32,0x0,0x0,0x3,0x61,0x2f,0x33,0x0,0x0,0x3,0x61,0x2f,0x34,0x0 };
+    byte subscribe2[] = { 0x82,0xe,0x0,0x3,0x0,0x3,0x61,0x2f,0x35,0x0,0x0,0x3,0x61,0x2f,0x36,0x0 };
+    shimClient.expect(subscribe1,28);
+
+    uint16_t writes = shimClient.writes();
+    rc = client.subscribe(topics,nullptr,6);
+    IS_TRUE(rc);
+    IS_TRUE(shimClient.writes() - writes == 1);
+    IS_TRUE(client.getInflightCount() == 1);
+
+    // The rest follow once the first is acknowledged
+    shimClient.expect(subscribe2,16);
+    byte suback[] = { 0x90,0x6,0x0,0x2,0x0,0x0,0x0,0x0 };
+    shimClient.respond(suback,8);
+    IS_TRUE(client.loop());
+    IS_TRUE(shimClient.writes() - writes == 2);
+    IS_TRUE(client.getInflightCount() == 1);
+    IS_TRUE(client.getLastMessageId() == 3);
+
+    // An invalid filter means nothing is sent or queued
+    writes = shimClient.writes();
+    uint8_t qos[] = { 0, 3 };
+    rc = client.subscribe(topics,qos,2);
+    IS_FALSE(rc);
+    IS_TRUE(shimClient.writes() == writes);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_subscribe_many_progress() {
+    IT("sends a long list of topic filters as the in-flight window frees up");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    char names[200][8];
+    const char* topics[200];
+    for (int i = 0; i < 200; i++) {
+        sprintf(names[i],"t/%03d",i);
+        topics[i] = names[i];
+    }
+
+    // Fifteen filters go in each packet, and there is room for four packets at a time
+    rc = client.subscribe(topics,nullptr,200);
+    IS_TRUE(rc);
+    IS_TRUE(client.getInflightCount() == MQTT_MAX_INFLIGHT);
+    IS_TRUE(client.getLastMessageId() == 5);
+
+    for (uint8_t msgId = 2; msgId <= 15; msgId++) {
+        byte suback[] = { 0x90,0x3,0x0,msgId,0x0 };
+        shimClient.respond(suback,5);
+        IS_TRUE(client.loop());
+    }
+    IS_TRUE(client.getInflightCount() == 0);
+    IS_TRUE(client.getLastMessageId() == 15);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_resubscribe() {
+    IT("subscribes again in one packet after reconnecting without the session");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    IS_TRUE(client.subscribe((char*)"a/1",1));
+    IS_TRUE(client.subscribe((char*)"a/2"));
+    IS_TRUE(client.subscribe((char*)"a/3"));
+    IS_TRUE(client.unsubscribe((char*)"a/2"));
+
+    byte suback[] = { 0x90,0x3,0x0,0x2,0x1 };
+    shimClient.respond(suback,5);
+    IS_TRUE(client.loop());
+
+    shimClient.setConnected(false);
+    IS_FALSE(client.connected());
+
+    byte connect[] = {0x10,0x18,0x0,0x4,0x4d,0x51,0x54,0x54,0x4,0x2,0x0,0xf,0x0,0xc,0x63,0x6c,0x69,0x65,0x6e,0x74,0x5f,0x74,0x65,0x73,0x74,0x31};
+    byte subscribe[] = { 0x82,0xe,0x0,0x2,0x0,0x3,0x61,0x2f,0x31,0x1,0x0,0x3,0x61,0x2f,0x33,0x0 };
+    shimClient.expect(connect,26);
+    shimClient.expect(subscribe,16);
+    shimClient.respond(connack,4);
+
+    uint16_t writes = shimClient.writes();
+    rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+    IS_TRUE(shimClient.writes() - writes == 2);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_resubscribe_many() {
+    IT("remembers more topic filters than there is first room for");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    char topics[MQTT_MAX_SUBSCRIPTIONS + 4][8];
+    for (int i = 0; i < MQTT_MAX_SUBSCRIPTIONS + 4; i++) {
+        sprintf(topics[i],"t/%02d",i);
+        IS_TRUE(client.subscribe(topics[i]));
+    }
+
+    shimClient.setConnected(false);
+    IS_FALSE(client.connected());
+
+    // Every filter is subscribed to again, seventeen to a packet
+    shimClient.respond(connack,4);
+    rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+    IS_TRUE(client.getInflightCount() == 2);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_resubscribe_session_present() {
+    IT("does not subscribe again when the server kept the session");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1",0,0,0,0,0,0,0);
+    IS_TRUE(rc);
+
+    IS_TRUE(client.subscribe((char*)"a/1"));
+
+    byte suback[] = { 0x90,0x3,0x0,0x2,0x0 };
+    shimClient.respond(suback,5);
+    IS_TRUE(client.loop());
+
+    shimClient.setConnected(false);
+    IS_FALSE(client.connected());
+
+    byte connect[] = {0x10,0x18,0x0,0x4,0x4d,0x51,0x54,0x54,0x4,0x0,0x0,0xf,0x0,0xc,0x63,0x6c,0x69,0x65,0x6e,0x74,0x5f,0x74,0x65,0x73,0x74,0x31};
+    byte resumed[] = { 0x20, 0x02, 0x01, 0x00 };
+    shimClient.expect(connect,26);
+    shimClient.respond(resumed,4);
+
+    rc = client.connect((char*)"client_test1",0,0,0,0,0,0,0);
+    IS_TRUE(rc);
+    IS_TRUE(client.getInflightCount() == 0);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_resubscribe_session_present_unacknowledged() {
+    IT("sends unacknowledged requests again when the server kept the session");
+    reset_subscribe_callback();
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    client.setSubscribeCallback(subscribe_callback);
+    int rc = client.connect((char*)"client_test1",0,0,0,0,0,0,0);
+    IS_TRUE(rc);
+
+    IS_TRUE(client.subscribe((char*)"a/1"));
+    byte suback[] = { 0x90,0x3,0x0,0x2,0x0 };
+    shimClient.respond(suback,5);
+    IS_TRUE(client.loop());
+
+    IS_TRUE(client.subscribe((char*)"a/2"));
+    IS_TRUE(client.unsubscribe((char*)"a/1"));
+    IS_TRUE(client.getInflightCount() == 2);
+
+    shimClient.setConnected(false);
+    IS_FALSE(client.connected());
+
+    byte connect[] = {0x10,0x18,0x0,0x4,0x4d,0x51,0x54,0x54,0x4,0x0,0x0,0xf,0x0,0xc,0x63,0x6c,0x69,0x65,0x6e,0x74,0x5f,0x74,0x65,0x73,0x74,0x31};
+    byte resumed[] = { 0x20, 0x02, 0x01, 0x00 };
+    byte subscribe[] = { 0x82,0x8,0x0,0x2,0x0,0x3,0x61,0x2f,0x32,0x0 };
+    byte unsubscribe[] = { 0xa2,0x7,0x0,0x3,0x0,0x3,0x61,0x2f,0x31 };
+    shimClient.expect(connect,26);
+    shimClient.expect(subscribe,10);
+    shimClient.expect(unsubscribe,9);
+    shimClient.respond(resumed,4);
+
+    rc = client.connect((char*)"client_test1",0,0,0,0,0,0,0);
+    IS_TRUE(rc);
+    IS_TRUE(ackCount == 3);
+    IS_TRUE(ackResults[0] == MQTT_SUBSCRIBE_FAILURE);
+    IS_TRUE(client.getInflightCount() == 2);
+
+    byte unsuback[] = { 0xb0,0x2,0x0,0x3 };
+    byte suback2[] = { 0x90,0x3,0x0,0x2,0x0 };
+    shimClient.respond(unsuback,4);
+    shimClient.respond(suback2,5);
+    IS_TRUE(client.loop());
+    IS_TRUE(client.loop());
+    IS_TRUE(client.getInflightCount() == 0);
+
+    shimClient.setConnected(false);
+    IS_FALSE(client.connected());
+
+    // Only a/2 is left to subscribe to in a new session
+    byte connectClean[] = {0x10,0x18,0x0,0x4,0x4d,0x51,0x54,0x54,0x4,0x2,0x0,0xf,0x0,0xc,0x63,0x6c,0x69,0x65,0x6e,0x74,0x5f,0x74,0x65,0x73,0x74,0x31};
+    byte resubscribe[] = { 0x82,0x8,0x0,0x2,0x0,0x3,0x61,0x2f,0x32,0x0 };
+    shimClient.expect(connectClean,26);
+    shimClient.expect(resubscribe,10);
+    shimClient.respond(connack,4);
+
+    rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+    IS_TRUE(client.getInflightCount() == 1);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_resubscribe_window() {
+    IT("subscribes again as the in-flight window allows");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    IS_TRUE(client.setBufferSize(32));
+    IS_TRUE(client.setInflightWindow(1));
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    const char* topics[] = { "a/1", "a/2", "a/3", "a/4", "a/5", "a/6" };
+    IS_TRUE(client.subscribe(topics,nullptr,4));
+    byte suback4[] = { 0x90,0x6,0x0,0x2,0x0,0x0,0x0,0x0 };
+    shimClient.respond(suback4,8);
+    IS_TRUE(client.loop());
+    IS_TRUE(client.subscribe(&topics[4],nullptr,2));
+
+    shimClient.setConnected(false);
+    IS_FALSE(client.connected());
+
+    byte connect[] = {0x10,0x18,0x0,0x4,0x4d,0x51,0x54,0x54,0x4,0x2,0x0,0xf,0x0,0xc,0x63,0x6c,0x69,0x65,0x6e,0x74,0x5f,0x74,0x65,0x73,0x74,0x31};
+    byte subscribe1[] = { 0x82,0x1a,0x0,0x2,0x0,0x3,0x61,0x2f,0x31,0x0,0x0,0x3,0x61,0x2f,0x32,0x0,0x0,0x3,0x61,0x2f,0x33,0x0,0x0,0x3,0x61,0x2f,0x34,0x0 };
+    byte subscribe2[] = { 0x82,0xe,0x0,0x3,0x0,0x3,0x61,0x2f,0x35,0x0,0x0,0x3,0x61,0x2f,0x36,0x0 };
+    shimClient.expect(connect,26);
+    shimClient.expect(subscribe1,28);
+    shimClient.respond(connack,4);
+
+    rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+    IS_TRUE(client.getInflightCount() == 1);
+
+    shimClient.expect(subscribe2,16);
+    byte suback[] = { 0x90,0x6,0x0,0x2,0x0,0x0,0x0,0x0 };
+    shimClient.respond(suback,8);
+    IS_TRUE(client.loop());
+    IS_TRUE(client.getInflightCount() == 1);
+    IS_TRUE(client.getLastMessageId() == 3);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
 int test_subscribe_not_connected() {
     IT("subscribe fails when not connected");
     ShimClient shimClient;
@@ -87,7 +629,7 @@ int test_subscribe_invalid_qos() {
     int rc = client.connect((char*)"client_test1");
     IS_TRUE(rc);
 
-    rc = client.subscribe((char*)"topic",2);
+    rc = client.subscribe((char*)"topic",3);
     IS_FALSE(rc);
     rc = client.subscribe((char*)"topic",254);
     IS_FALSE(rc);
@@ -149,6 +691,30 @@ int test_unsubscribe() {
     END_IT
 }
 
+int test_unsubscribe_many() {
+    IT("unsubscribes from several topic filters in one packet");
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, callback, shimClient);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    const char* topics[] = { "a/1", "a/2" };
+    byte unsubscribe[] = { 0xa2,0xc,0x0,0x2,0x0,0x3,0x61,0x2f,0x31,0x0,0x3,0x61,0x2f,0x32 };
+    shimClient.expect(unsubscribe,14);
+
+    rc = client.unsubscribe(topics,2);
+    IS_TRUE(rc);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
 int test_unsubscribe_not_connected() {
     IT("unsubscribe fails when not connected");
     ShimClient shimClient;
@@ -168,10 +734,24 @@ int main()
     SUITE("Subscribe");
     test_subscribe_no_qos();
     test_subscribe_qos_1();
+    test_subscribe_qos_2();
+    test_subscribe_inflight();
+    test_subscribe_callback();
+    test_subscribe_callback_session_lost();
+    test_subscribe_many();
+    test_subscribe_many_split();
+    test_subscribe_many_no_room();
+    test_subscribe_many_progress();
+    test_resubscribe();
+    test_resubscribe_many();
+    test_resubscribe_session_present();
+    test_resubscribe_session_present_unacknowledged();
+    test_resubscribe_window();
     test_subscribe_not_connected();
     test_subscribe_invalid_qos();
     test_subscribe_too_long();
     test_unsubscribe();
+    test_unsubscribe_many();
     test_unsubscribe_not_connected();
     FINISH
 }
@@ -0,0 +1,223 @@
+#include "PubSubClient.h"
+#include "ShimClient.h"
+#include "Buffer.h"
+#include "BDDTest.h"
+#include "trace.h"
+
+
+byte server[] = { 172, 16, 0, 2 };
+
+int handlerCalls[3];
+char lastTopic[1024];
+char lastPayload[1024];
+unsigned int lastLength;
+
+void reset_handlers() {
+    memset(handlerCalls,0,sizeof(handlerCalls));
+    lastTopic[0] = '\0';
+    lastPayload[0] = '\0';
+    lastLength = 0;
+}
+
+void record(int handler, const char* topic, uint16_t topicLength, const byte* payload, unsigned int length) {
+    handlerCalls[handler]++;
+    memcpy(lastTopic,topic,topicLength);
+    lastTopic[topicLength] = '\0';
+    memcpy(lastPayload,payload,length);
+    lastLength = length;
+}
+
+void light(const char* topic, uint16_t topicLength, const byte* payload, unsigned int length, uint8_t qos, boolean retained) {
+    record(0,topic,topicLength,payload,length);
+}
+
+void heating(const char* topic, uint16_t topicLength, const byte* payload, unsigned int length, uint8_t qos, boolean retained) {
+    record(1,topic,topicLength,payload,length);
+}
+
+void other(const char* topic, uint16_t topicLength, const byte* payload, unsigned int length, uint8_t qos, boolean retained) {
+    record(2,topic,topicLength,payload,length);
+}
+
+constexpr TopicTable<3> homeTopics({ TopicEntry("home/light", light),
+                                     TopicEntry("home/heating", heating),
+                                     TopicEntry("topic", other) });
+
+constexpr TopicTable<20> manyTopics({
+    TopicEntry("device/0", other),  TopicEntry("device/1", other),  TopicEntry("device/2", other),
+    TopicEntry("device/3", other),  TopicEntry("device/4", other),  TopicEntry("device/5", other),
+    TopicEntry("device/6", other),  TopicEntry("device/7", other),  TopicEntry("device/8", other),
+    TopicEntry("device/9", other),  TopicEntry("device/10", other), TopicEntry("device/11", other),
+    TopicEntry("device/12", light), TopicEntry("device/13", other), TopicEntry("device/14", other),
+    TopicEntry("device/15", other), TopicEntry("device/16", other), TopicEntry("device/17", other),
+    TopicEntry("device/18", other), TopicEntry("device/19", heating) });
+
+// As large as a table can be, with topics that share most of their length
+#define SENSOR(n) TopicEntry("devices/sensor-" #n "/telemetry/value", other)
+#define SENSORS(n) SENSOR(n##0), SENSOR(n##1), SENSOR(n##2), SENSOR(n##3), SENSOR(n##4), \
+                   SENSOR(n##5), SENSOR(n##6), SENSOR(n##7), SENSOR(n##8), SENSOR(n##9)
+
+constexpr TopicTable<MQTT_MAX_TABLE_TOPICS> sensorTopics({
+    SENSORS(0), SENSORS(1), SENSORS(2), SENSORS(3), SENSORS(4), SENSORS(5),
+    SENSOR(60), SENSOR(61), SENSOR(62), SENSOR(63) });
+
+// Placed in program memory on AVR, topics and all
+constexpr char lightTopic[] PROGMEM = "home/light";
+constexpr char heatingTopic[] PROGMEM = "home/heating";
+constexpr TopicTable<2> flashTopics PROGMEM ({ TopicEntry(lightTopic, light),
+                                               TopicEntry(heatingTopic, heating) });
+
+// Built entirely at compile time
+static_assert(homeTopics.entries[1].length == 12, "topic lengths are worked out at compile time");
+static_assert(TopicTable<3>::SLOTS == 16, "a table has four slots per topic, rounded up to a power of two");
+
+const TopicEntry* find(const TopicTableRef& table, const char* topic) {
+    return table.find(topic,strlen(topic));
+}
+
+int test_topic_table_find() {
+    IT("finds the entry for each topic of a table");
+    TopicTableRef table(homeTopics);
+
+    IS_TRUE(find(table,"home/light") == &homeTopics.entries[0]);
+    IS_TRUE(find(table,"home/heating") == &homeTopics.entries[1]);
+    IS_TRUE(find(table,"topic") == &homeTopics.entries[2]);
+
+    END_IT
+}
+
+int test_topic_table_unknown() {
+    IT("finds nothing for topics not in a table");
+    TopicTableRef table(homeTopics);
+
+    IS_TRUE(find(table,"home/ligh") == nullptr);
+    IS_TRUE(find(table,"home/light/") == nullptr);
+    IS_TRUE(find(table,"home/door") == nullptr);
+    IS_TRUE(find(table,"") == nullptr);
+
+    for (int i = 0; i < 200; i++) {
+        char topic[16];
+        sprintf(topic,"unknown/%d",i);
+        IS_TRUE(find(table,topic) == nullptr);
+    }
+
+    END_IT
+}
+
+int test_topic_table_many() {
+    IT("gives every topic of a larger table a slot of its own");
+    TopicTableRef table(manyTopics);
+
+    for (int i = 0; i < 20; i++) {
+        char topic[16];
+        sprintf(topic,"device/%d",i);
+        IS_TRUE(find(table,topic) == &manyTopics.entries[i]);
+    }
+    IS_TRUE(find(table,"device/20") == nullptr);
+
+    END_IT
+}
+
+int test_topic_table_largest() {
+    IT("gives every topic of the largest table a slot of its own");
+    TopicTableRef table(sensorTopics);
+
+    for (int i = 0; i < MQTT_MAX_TABLE_TOPICS; i++) {
+        char topic[40];
+        sprintf(topic,"devices/sensor-%02d/telemetry/value",i);
+        IS_TRUE(find(table,topic) == &sensorTopics.entries[i]);
+    }
+    IS_TRUE(find(table,"devices/sensor-64/telemetry/value") == nullptr);
+
+    END_IT
+}
+
+int test_topic_table_client() {
+    IT("dispatches received messages through a topic table");
+    reset_handlers();
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, shimClient);
+    client.setTopicTable(homeTopics);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    byte publish[] = {0x30,0xe,0x0,0x5,0x74,0x6f,0x70,0x69,0x63,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    shimClient.respond(publish,16);
+
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(handlerCalls[2] == 1);
+    IS_TRUE(handlerCalls[0] == 0);
+    IS_TRUE(strcmp(lastTopic,"topic")==0);
+    IS_TRUE(memcmp(lastPayload,"payload",7)==0);
+    IS_TRUE(lastLength == 7);
+
+    // A topic the table does not have reaches no handler
+    byte unknown[] = {0x30,0xe,0x0,0x5,0x74,0x6f,0x70,0x69,0x78,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    shimClient.respond(unknown,16);
+
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(handlerCalls[2] == 1);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int test_topic_table_progmem() {
+    IT("dispatches received messages through a topic table in program memory");
+    reset_handlers();
+    ShimClient shimClient;
+    shimClient.setAllowConnect(true);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883, shimClient);
+    client.setTopicTable_P(flashTopics);
+    int rc = client.connect((char*)"client_test1");
+    IS_TRUE(rc);
+
+    // home/heating
+    byte publish[] = {0x30,0x15,0x0,0xc,0x68,0x6f,0x6d,0x65,0x2f,0x68,0x65,0x61,0x74,0x69,0x6e,0x67,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    shimClient.respond(publish,23);
+
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(handlerCalls[1] == 1);
+    IS_TRUE(handlerCalls[0] == 0);
+    IS_TRUE(strcmp(lastTopic,"home/heating")==0);
+    IS_TRUE(lastLength == 7);
+
+    // home/heatinx
+    byte unknown[] = {0x30,0x15,0x0,0xc,0x68,0x6f,0x6d,0x65,0x2f,0x68,0x65,0x61,0x74,0x69,0x6e,0x78,0x70,0x61,0x79,0x6c,0x6f,0x61,0x64};
+    shimClient.respond(unknown,23);
+
+    rc = client.loop();
+    IS_TRUE(rc);
+    IS_TRUE(handlerCalls[1] == 1);
+
+    IS_FALSE(shimClient.error());
+
+    END_IT
+}
+
+int main()
+{
+    SUITE("Topic table");
+
+    test_topic_table_find();
+    test_topic_table_unknown();
+    test_topic_table_many();
+    test_topic_table_largest();
+    test_topic_table_client();
+    test_topic_table_progmem();
+
+    FINISH
+}